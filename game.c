@@ -5,18 +5,82 @@
 #include <termios.h>
 #include <signal.h>
 #include <string.h>
+#include <stdint.h>
+#include <assert.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+#include <fcntl.h>
 
-#ifdef RUN_TESTS
+enum {
+    ENGINE_SCAN, // in-place scan over the active cells
+    ENGINE_BITBOARD, // whole rows at a time with bitwise ops
+    ENGINE_LUT, // same scan as ENGINE_SCAN, cells updated from a lookup table
+    ENGINE_TWO_BUFFER, // different rules: every cell reads only the previous board
+    ENGINE_ENTITIES, // same scan as ENGINE_SCAN, over a list of the rocks and gems
+};
 
-#define MAX_X 5
-#define MAX_Y 4
+typedef struct {
+    int x;
+    int y;
+    char c;
+} CellChange;
 
-#else
+// The board as one bit plane per kind of tile. Walls, earth and the exit
+// are never told apart by the physics, they are simply none of these.
+// Row y of a plane starts at word y * row_words. The planes have one more
+// row than the board, left empty, so the bottom row can look below itself.
+typedef struct {
+    uint64_t* rest; // O $
+    uint64_t* fall; // o S
+    uint64_t* gem; // $ S
+    uint64_t* empty;
+    uint64_t* player;
+} BitBoard;
 
-#define MAX_X 60
-#define MAX_Y 26
+// The board is stored in CHUNK_SIZE x CHUNK_SIZE chunks. A chunk where every
+// cell holds the same tile, and nothing that moves, is just that tile until
+// something is written into it. Big levels are mostly wall and untouched earth,
+// so memory and the cost of a tick follow the parts where something happens.
+#define CHUNK_SHIFT 5
+#define CHUNK_SIZE (1 << CHUNK_SHIFT)
+#define CHUNK_MASK (CHUNK_SIZE - 1)
 
-#endif
+// Cell (x, y) of a chunk is at y * CHUNK_SIZE + x.
+typedef struct {
+    char tiles[2][CHUNK_SIZE * CHUNK_SIZE]; // the chunk's part of both boards, see GameState.front
+    uint32_t active[CHUNK_SIZE]; // one word per row, bit i is column i
+    uint32_t damaged[CHUNK_SIZE];
+    int active_count;
+} ChunkData;
+
+typedef struct {
+    ChunkData* data; // NULL while the chunk is uniform or only in a file
+    const uint8_t* cells; // streamed levels: without data, the chunk packed in the level or spill file
+    char fill; // every cell of a uniform chunk
+    int gems; // $ and S on the latest board, render animates those
+} Chunk;
+
+// Rocks and gems for ENGINE_ENTITIES, entry k of each array is one object.
+typedef struct {
+    int* x;
+    int* y;
+    uint8_t* gem;
+    uint8_t* falling; // o S and the p i markers
+} EntityArrays;
+
+typedef struct {
+    int count;
+    int capacity;
+    EntityArrays live; // in scan order: bottom to top, right to left
+    EntityArrays moved; // scratch for putting the moved entries back in order
+    uint8_t* has_moved;
+} EntityStore;
+
+typedef struct WorkerPool WorkerPool;
+typedef struct Stream Stream;
 
 typedef struct {
     int key;
@@ -24,18 +88,68 @@ typedef struct {
     int pos_y;
     unsigned int count; // unsigned, so overflow will be fine
     int gems_collected;
+    int level_gems; // gems in the level as it was loaded
+    int settled; // nothing on the board moves until the player does, see settle_level()
     int dead;
     int won;
-    char old_screen[MAX_Y][MAX_X];
-    char screen[MAX_Y][MAX_X];
+    // Read from the level. Like in the level file, every row ends with
+    // a '\n', so width includes that column.
+    int width;
+    int height;
+    int row_words; // 64 bit words per row in the bit planes, bit i of a row is column i
+    int chunks_x;
+    int chunks_y;
+    int chunk_words; // 64 bit words per row of chunks in the chunk bitsets
+    Chunk* chunks; // chunk (cx, cy) is chunks[cy * chunks_x + cx]
+    // Every chunk holds two boards, old_screen and screen. old_screen is the
+    // board of the previous tick, screen is the one being built. tiles[front]
+    // is screen, flipping front after every tick swaps them, so screen starts
+    // out one tick behind, but only in the cells that were written during that tick.
+    int front;
+    int damage_count;
+    int damage_capacity;
+    int64_t* damage; // y * width + x of each cell written since the last sync
+    uint64_t board_hash; // Zobrist hash of the latest board, kept up to date by set_cell()
+    long resident_chunks; // chunks with data
+    Stream* stream; // NULL unless the level is streamed, see stream_level()
+    // Cells which might change on the next physics pass. Everything else is
+    // resting and stays resting until one of its neighbors changes.
+    // The cells are marked in the chunks. A chunk with any of them is awake,
+    // the others sleep until a write in or next to them wakes a cell.
+    // awake_bands has a bit for every row of chunks with an awake chunk, so a
+    // settled board costs a few word reads per tick, however large it is.
+    int prepared;
+    uint64_t* awake_chunks;
+    uint64_t* awake_bands;
+    int engine;
+    BitBoard planes; // only allocated and kept up to date by ENGINE_BITBOARD
+    CellChange* changes; // ENGINE_TWO_BUFFER: the next board, as the cells that differ
+    uint64_t* proposed_chunks; // ENGINE_TWO_BUFFER: the chunks computed in this pass
+    uint64_t* proposed_bands;
+    WorkerPool* pool; // ENGINE_TWO_BUFFER: splits the rows between threads if set
+    EntityStore entities; // ENGINE_ENTITIES: built from the board on the first tick
+    // A tick whose physics pass did not fit into the budget of update_slice(),
+    // and where the pass goes on, see update_all_elements_until().
+    int mid_pass;
+    int scan_cy;
+    int scan_y;
+    int scan_x;
+    // The part of the board shown on the terminal, it follows the player.
+    int view_x;
+    int view_y;
+    int view_width;
+    int view_height;
+    int redraw; // draw the whole view on the next render, not just what changed
+    uint64_t* skipped; // a bit per cell of the view written by ticks that were not rendered, see skip_render()
 } GameState;
 
 static struct termios old_termios, new_termios;
+static int view_rows; // rows used by the board on the terminal
 
 void reset_terminal() {
     printf("\e[m"); // reset color changes
     printf("\e[?25h"); // show cursor
-    printf("\e[%d;%dH\n", MAX_Y + 3, MAX_X); // move cursor after game board
+    printf("\e[%d;%dH\n", view_rows + 3, 1); // move cursor after game board
     fflush(stdout);
     tcsetattr(STDIN_FILENO, TCSANOW, &old_termios);
 }
@@ -78,24 +192,500 @@ void read_input(GameState* state) {
     int final_key = 0;
     // it's okay if we miss some keys
     // we will correct it on next frame
-    for (int k = 0; k <= n - 3; k += 3) {
-        int key = read_key(buf, k);
-        if (key == 0) continue;
+    for (int k = 0; k < n; ++k) {
+        int key = k <= n - 3 ? read_key(buf, k) : 0;
+        if (key != 0) {
+            k += 2;
+        } else if (buf[k] == 0x7f) {
+            key = 5; // BACKSPACE, rewinds
+        } else {
+            continue;
+        }
         final_key = key;
     }
     state->key = final_key;
 }
 
+void* allocate(size_t count, size_t size) {
+    void* p = calloc(count, size);
+    if (!p) {
+        fprintf(stderr, "Out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+    return p;
+}
+
+void* reallocate(void* p, size_t size) {
+    p = realloc(p, size);
+    if (!p) {
+        fprintf(stderr, "Out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+    return p;
+}
+
+static inline size_t board_size(const GameState* state) {
+    return (size_t)state->width * state->height;
+}
+
+// Sets up an empty width x height board, every chunk uniform, and whatever is sized by it.
+// The bit planes and the change list are only allocated for the engines that use them.
+void init_game_state(GameState* state, int width, int height) {
+    state->width = width;
+    state->height = height;
+    state->row_words = (width + 63) / 64;
+    state->chunks_x = (width + CHUNK_MASK) >> CHUNK_SHIFT;
+    state->chunks_y = (height + CHUNK_MASK) >> CHUNK_SHIFT;
+    state->chunk_words = (state->chunks_x + 63) / 64;
+    state->chunks = allocate((size_t)state->chunks_x * state->chunks_y, sizeof(Chunk));
+    state->awake_chunks = allocate((size_t)state->chunk_words * state->chunks_y, sizeof(uint64_t));
+    state->awake_bands = allocate((state->chunks_y + 63) / 64, sizeof(uint64_t));
+    state->damage_capacity = 1024;
+    state->damage = allocate(state->damage_capacity, sizeof(int64_t));
+    if (state->engine == ENGINE_BITBOARD) {
+        size_t plane = (size_t)state->row_words * (height + 1);
+        uint64_t* planes = allocate(5 * plane, sizeof(uint64_t));
+        state->planes = (BitBoard){ planes, planes + plane, planes + 2 * plane, planes + 3 * plane, planes + 4 * plane };
+    }
+    if (state->engine == ENGINE_TWO_BUFFER) {
+        state->changes = allocate(board_size(state), sizeof(CellChange));
+        state->proposed_chunks = allocate((size_t)state->chunk_words * state->chunks_y, sizeof(uint64_t));
+        state->proposed_bands = allocate((state->chunks_y + 63) / 64, sizeof(uint64_t));
+    }
+}
+
+// A level played straight from its mapped binary file, see stream_level(). Only the
+// chunks that are needed are unpacked, and once more than max_resident chunks are,
+// sleeping chunks away from the player are packed again, into the spill file.
+struct Stream {
+    const uint8_t* level;
+    size_t level_size;
+    int mapped; // munmap level when done, not free
+    long max_resident;
+    uint8_t* spill; // mapped, chunk k is packed at k * PACKED_CHUNK_SIZE once it was evicted
+    size_t spill_size;
+    size_t hand; // where the eviction sweep goes on, see stream_chunks()
+    long evicted;
+};
+
+void free_stream(Stream* stream) {
+    if (!stream) return;
+    if (stream->mapped) {
+        munmap((void*)stream->level, stream->level_size);
+    } else {
+        free((void*)stream->level);
+    }
+    munmap(stream->spill, stream->spill_size);
+    free(stream);
+}
+
+void free_game_state(GameState* state) {
+    for (size_t k = 0; k < (size_t)state->chunks_x * state->chunks_y; ++k) {
+        free(state->chunks[k].data);
+    }
+    free(state->chunks);
+    free(state->awake_chunks);
+    free(state->awake_bands);
+    free(state->damage);
+    free(state->planes.rest);
+    free(state->changes);
+    free(state->proposed_chunks);
+    free(state->proposed_bands);
+    EntityArrays* arrays[2] = { &state->entities.live, &state->entities.moved };
+    for (int k = 0; k < 2; ++k) {
+        free(arrays[k]->x);
+        free(arrays[k]->y);
+        free(arrays[k]->gem);
+        free(arrays[k]->falling);
+    }
+    free(state->entities.has_moved);
+    free_stream(state->stream);
+    free(state->skipped);
+}
+
+static inline Chunk* chunk_at(const GameState* state, int x, int y) {
+    return &state->chunks[(size_t)(y >> CHUNK_SHIFT) * state->chunks_x + (x >> CHUNK_SHIFT)];
+}
+
+static inline int chunk_cell(int x, int y) {
+    return (y & CHUNK_MASK) * CHUNK_SIZE + (x & CHUNK_MASK);
+}
+
+// Tiles packed into 4 bits are numbered by their index here.
+static const char packed_tiles[16] = " X.OoS$@Epi\n";
+
+// Tile code + 1, 0 for characters that are not a tile.
+static const uint8_t tile_codes[256] = {
+    [' '] = 1, ['X'] = 2, ['.'] = 3, ['O'] = 4, ['o'] = 5, ['S'] = 6,
+    ['$'] = 7, ['@'] = 8, ['E'] = 9, ['p'] = 10, ['i'] = 11, ['\n'] = 12,
+};
+
+// Bounds-checked read of one of the two boards, everything outside is wall.
+// board is state->front for screen and state->front ^ 1 for old_screen.
+static inline char board_cell(const GameState* state, int board, int x, int y) {
+    if ((unsigned)x >= (unsigned)state->width || (unsigned)y >= (unsigned)state->height) return 'X';
+    const Chunk* chunk = chunk_at(state, x, y);
+    if (chunk->data) return chunk->data->tiles[board][chunk_cell(x, y)];
+    if (chunk->cells) return packed_tiles[(chunk->cells[chunk_cell(x, y) >> 1] >> ((x & 1) * 4)) & 15];
+    return chunk->fill;
+}
+
+static inline char get_cell(const GameState* state, int x, int y) {
+    return board_cell(state, state->front, x, y);
+}
+
+static inline char get_old_cell(const GameState* state, int x, int y) {
+    return board_cell(state, state->front ^ 1, x, y);
+}
+
+static inline int is_gem(char c) {
+    return c == '$' || c == 'S';
+}
+
+static inline uint64_t get_le(const uint8_t* p, int bytes) {
+    uint64_t v = 0;
+    for (int i = bytes - 1; i >= 0; --i) v = v << 8 | p[i];
+    return v;
+}
+
+static inline void put_le(uint8_t* p, uint64_t v, int bytes) {
+    for (int i = 0; i < bytes; ++i) p[i] = (uint8_t)(v >> (8 * i));
+}
+
+// FNV-1a, but a word at a time, so checking a level of many megabytes stays cheap.
+#define CHECKSUM_SEED 0xcbf29ce484222325ULL
+
+uint64_t level_checksum(uint64_t hash, const uint8_t* p, size_t n) {
+    for (; n >= 8; p += 8, n -= 8) hash = (hash ^ get_le(p, 8)) * 0x100000001b3ULL;
+    for (; n > 0; ++p, --n) hash = (hash ^ *p) * 0x100000001b3ULL;
+    return hash;
+}
+
+// The packed form of the board, a chunk at a time, for everything that keeps a copy
+// of it: binary levels, chunks packed away by a streamed level and the keyframes of
+// replays. Its cells in the order of chunk_cell(), two to a byte with the low nibble
+// first, and a level_checksum() of them.
+#define PACKED_CELLS (CHUNK_SIZE * CHUNK_SIZE / 2)
+#define PACKED_CHUNK_SIZE (PACKED_CELLS + 8)
+
+void pack_chunk(const char* tiles, uint8_t* packed) {
+    for (int i = 0; i < CHUNK_SIZE * CHUNK_SIZE; i += 2) {
+        packed[i >> 1] = (uint8_t)((tile_codes[(uint8_t)tiles[i]] - 1) | (tile_codes[(uint8_t)tiles[i + 1]] - 1) << 4);
+    }
+    put_le(&packed[PACKED_CELLS], level_checksum(CHECKSUM_SEED, packed, PACKED_CELLS), 8);
+}
+
+// Returns -1 if the packed chunk is damaged.
+int unpack_chunk(const uint8_t* packed, char* tiles) {
+    if (level_checksum(CHECKSUM_SEED, packed, PACKED_CELLS) != get_le(&packed[PACKED_CELLS], 8)) return -1;
+    int unknown = 0; // codes past the end of packed_tiles
+    for (int i = 0; i < CHUNK_SIZE * CHUNK_SIZE; i += 2) {
+        tiles[i] = packed_tiles[packed[i >> 1] & 15];
+        tiles[i + 1] = packed_tiles[packed[i >> 1] >> 4];
+        unknown |= (packed[i >> 1] & 15) > 11 || packed[i >> 1] >> 4 > 11;
+    }
+    return unknown ? -1 : 0;
+}
+
+// $ and S of the cells of a chunk that are on the board.
+int count_chunk_gems(const GameState* state, const Chunk* chunk) {
+    size_t k = chunk - state->chunks;
+    int x0 = (k % state->chunks_x) * CHUNK_SIZE, y0 = (k / state->chunks_x) * CHUNK_SIZE;
+    int x1 = x0 + CHUNK_SIZE < state->width ? x0 + CHUNK_SIZE : state->width;
+    int y1 = y0 + CHUNK_SIZE < state->height ? y0 + CHUNK_SIZE : state->height;
+    int gems = 0;
+    for (int y = y0; y < y1; ++y) {
+        for (int x = x0; x < x1; ++x) gems += is_gem(chunk->data->tiles[0][chunk_cell(x, y)]);
+    }
+    return gems;
+}
+
+// Gives a chunk its own cells, so they can be written. Those of a uniform
+// chunk are its fill, those of a packed chunk are unpacked.
+// Returns -1 if the packed cells are damaged.
+int unpack_chunk_data(GameState* state, Chunk* chunk) {
+    if (chunk->data) return 0;
+    chunk->data = allocate(1, sizeof(ChunkData));
+    ++state->resident_chunks;
+    if (!chunk->cells) {
+        memset(chunk->data->tiles, chunk->fill, sizeof(chunk->data->tiles));
+        return 0;
+    }
+    if (unpack_chunk(chunk->cells, chunk->data->tiles[0]) != 0) return -1;
+    memcpy(chunk->data->tiles[1], chunk->data->tiles[0], sizeof(chunk->data->tiles[0]));
+    chunk->cells = NULL;
+    chunk->gems = count_chunk_gems(state, chunk);
+    return 0;
+}
+
+// Packed chunks of a streamed level are only checked when they are needed.
+ChunkData* materialize_chunk(GameState* state, Chunk* chunk) {
+    if (unpack_chunk_data(state, chunk) != 0) {
+        fprintf(stderr, "The level file is damaged, a chunk does not match its checksum\n");
+        exit(EXIT_FAILURE);
+    }
+    return chunk->data;
+}
+
+// Zobrist keys, one random looking 64 bit number for every tile in every cell.
+// They are computed from the cell and tile, a table of them for a big level would
+// be many times the size of the board. The hash of a board is all its keys xored,
+// so changing a cell only needs the keys of its old and new tile.
+static inline uint64_t cell_key(int64_t index, char c) {
+    uint64_t z = ((uint64_t)index << 8 | (uint8_t)c) + 0x9e3779b97f4a7c15ULL; // splitmix64
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+void clear_awake_chunks(GameState* state) {
+    memset(state->awake_chunks, 0, sizeof(uint64_t) * state->chunk_words * state->chunks_y);
+    memset(state->awake_bands, 0, sizeof(uint64_t) * ((state->chunks_y + 63) / 64));
+}
+
+// Replaces both boards with width * height tiles, laid out like the level file.
+// Chunks without anything that moves, whose cells are all the same, stay uniform.
+void load_board(GameState* state, const char* tiles) {
+    state->resident_chunks = 0;
+    for (int cy = 0; cy < state->chunks_y; ++cy) {
+        for (int cx = 0; cx < state->chunks_x; ++cx) {
+            Chunk* chunk = &state->chunks[cy * state->chunks_x + cx];
+            int x0 = cx * CHUNK_SIZE, y0 = cy * CHUNK_SIZE;
+            int x1 = x0 + CHUNK_SIZE < state->width ? x0 + CHUNK_SIZE : state->width;
+            int y1 = y0 + CHUNK_SIZE < state->height ? y0 + CHUNK_SIZE : state->height;
+            char fill = tiles[(size_t)y0 * state->width + x0];
+            int uniform = !strchr("O$oSpi@", fill) && x1 - x0 == CHUNK_SIZE && y1 - y0 == CHUNK_SIZE;
+            for (int y = y0; y < y1 && uniform; ++y) {
+                for (int x = x0; x < x1 && uniform; ++x) uniform = tiles[(size_t)y * state->width + x] == fill;
+            }
+            free(chunk->data);
+            *chunk = (Chunk){ .fill = fill };
+            if (uniform) continue;
+            ChunkData* data = materialize_chunk(state, chunk);
+            for (int y = y0; y < y1; ++y) {
+                for (int x = x0; x < x1; ++x) {
+                    char c = tiles[(size_t)y * state->width + x];
+                    data->tiles[0][chunk_cell(x, y)] = data->tiles[1][chunk_cell(x, y)] = c;
+                    chunk->gems += is_gem(c);
+                }
+            }
+        }
+    }
+    state->board_hash = 0;
+    for (size_t k = 0; k < board_size(state); ++k) state->board_hash ^= cell_key(k, tiles[k]);
+    clear_awake_chunks(state);
+    state->damage_count = 0;
+    state->prepared = 0;
+}
+
+// Reads row y of one of the boards, chunk by chunk.
+void read_row(const GameState* state, int board, int y, char* row) {
+    for (int cx = 0; cx < state->chunks_x; ++cx) {
+        const Chunk* chunk = &state->chunks[(size_t)(y >> CHUNK_SHIFT) * state->chunks_x + cx];
+        int x0 = cx * CHUNK_SIZE;
+        int n = x0 + CHUNK_SIZE < state->width ? CHUNK_SIZE : state->width - x0;
+        if (chunk->data) {
+            memcpy(&row[x0], &chunk->data->tiles[board][chunk_cell(0, y)], n);
+        } else if (chunk->cells) {
+            for (int i = 0; i < n; ++i) row[x0 + i] = packed_tiles[(chunk->cells[chunk_cell(i, y) >> 1] >> ((i & 1) * 4)) & 15];
+        } else {
+            memset(&row[x0], chunk->fill, n);
+        }
+    }
+}
+
+// Writes one of the boards out as width * height tiles, laid out like the level file.
+void copy_board(const GameState* state, int board, char* tiles) {
+    for (int y = 0; y < state->height; ++y) {
+        read_row(state, board, y, &tiles[(size_t)y * state->width]);
+    }
+}
+
+// The whole board at once, for checking the incremental hash.
+uint64_t hash_board(const GameState* state, int board) {
+    char* row = allocate(state->width, 1);
+    uint64_t hash = 0;
+    for (int y = 0; y < state->height; ++y) {
+        read_row(state, board, y, row);
+        for (int x = 0; x < state->width; ++x) hash ^= cell_key((int64_t)y * state->width + x, row[x]);
+    }
+    free(row);
+    return hash;
+}
+
+// The board and what the board does not show about the player. Equal states
+// have equal hashes, so it works as a checksum of a run and as a key for states.
+uint64_t state_hash(const GameState* state) {
+    int64_t player = (int64_t)state->gems_collected << 2 | state->dead << 1 | state->won;
+    return state->board_hash ^ cell_key(-1 - player, 0); // below the keys of the cells
+}
+
+void swap_screens(GameState* state) {
+    state->front ^= 1;
+}
+
+// Brings screen up to date with old_screen by copying back only the cells
+// written since the last sync. It works whether or not the buffers were
+// swapped after that tick, the damaged cells are the only ones that differ.
+void sync_screens(GameState* state) {
+    for (int k = 0; k < state->damage_count; ++k) {
+        int x = state->damage[k] % state->width;
+        int y = state->damage[k] / state->width;
+        ChunkData* data = chunk_at(state, x, y)->data; // written cells are never in a uniform chunk
+        data->tiles[state->front][chunk_cell(x, y)] = data->tiles[state->front ^ 1][chunk_cell(x, y)];
+        data->damaged[y & CHUNK_MASK] = 0;
+    }
+    state->damage_count = 0;
+}
+
+ChunkData* page_in_chunk(GameState* state, int cx, int cy);
+
+void wake_cell(GameState* state, int x, int y) {
+    // row 0 and the two outermost columns are never updated
+    if (x < 1 || x > state->width - 2 || y < 1 || y > state->height - 1) return;
+    Chunk* chunk = chunk_at(state, x, y);
+    if (!chunk->data) {
+        if (!chunk->cells) return; // a uniform chunk holds nothing that moves
+        page_in_chunk(state, x >> CHUNK_SHIFT, y >> CHUNK_SHIFT);
+    }
+    uint32_t* row = &chunk->data->active[y & CHUNK_MASK];
+    uint32_t bit = 1u << (x & CHUNK_MASK);
+    if (*row & bit) return;
+    *row |= bit;
+    if (chunk->data->active_count++ == 0) {
+        int cx = x >> CHUNK_SHIFT, cy = y >> CHUNK_SHIFT;
+        state->awake_chunks[(size_t)cy * state->chunk_words + (cx >> 6)] |= 1ULL << (cx & 63);
+        state->awake_bands[cy >> 6] |= 1ULL << (cy & 63);
+    }
+}
+
+// For a chunk whose last active cell is gone.
+void sleep_chunk(GameState* state, int cx, int cy) {
+    uint64_t* band = &state->awake_chunks[(size_t)cy * state->chunk_words];
+    band[cx >> 6] &= ~(1ULL << (cx & 63));
+    for (int w = 0; w < state->chunk_words; ++w) {
+        if (band[w]) return;
+    }
+    state->awake_bands[cy >> 6] &= ~(1ULL << (cy & 63));
+}
+
+void bitboard_set(GameState* state, int x, int y, char c) {
+    BitBoard* planes = &state->planes;
+    size_t w = (size_t)y * state->row_words + (x >> 6);
+    uint64_t bit = 1ULL << (x & 63);
+    planes->rest[w] &= ~bit;
+    planes->fall[w] &= ~bit;
+    planes->gem[w] &= ~bit;
+    planes->empty[w] &= ~bit;
+    planes->player[w] &= ~bit;
+    switch (c) {
+        case '$': planes->gem[w] |= bit; // fallthrough
+        case 'O': planes->rest[w] |= bit; break;
+        case 'S': planes->gem[w] |= bit; // fallthrough
+        case 'o': planes->fall[w] |= bit; break;
+        case ' ': planes->empty[w] |= bit; break;
+        case '@': planes->player[w] |= bit; break;
+        default: break;
+    }
+}
+
+// Every write to the board goes through here.
+// A rock or gem at (x, y) looks at its left and right neighbors
+// and at the three cells below them, so a change at (x, y) can
+// only make the cells next to it and above it unstable.
+void set_cell(GameState* state, int x, int y, char c) {
+    Chunk* chunk = chunk_at(state, x, y);
+    if (!chunk->data && !chunk->cells && chunk->fill == c) return;
+    ChunkData* data = chunk->cells ? page_in_chunk(state, x >> CHUNK_SHIFT, y >> CHUNK_SHIFT) : materialize_chunk(state, chunk);
+    char* cell = &data->tiles[state->front][chunk_cell(x, y)];
+    if (*cell == c) return;
+    int64_t index = (int64_t)y * state->width + x;
+    chunk->gems += is_gem(c) - is_gem(*cell);
+    state->board_hash ^= cell_key(index, *cell) ^ cell_key(index, c);
+    *cell = c;
+    uint32_t bit = 1u << (x & CHUNK_MASK);
+    if (!(data->damaged[y & CHUNK_MASK] & bit)) {
+        data->damaged[y & CHUNK_MASK] |= bit;
+        if (state->damage_count == state->damage_capacity) {
+            state->damage_capacity *= 2;
+            state->damage = reallocate(state->damage, sizeof(int64_t) * state->damage_capacity);
+        }
+        state->damage[state->damage_count++] = index;
+    }
+    for (int j = y - 1; j <= y; ++j) {
+        for (int i = x - 1; i <= x + 1; ++i) {
+            wake_cell(state, i, j);
+        }
+    }
+    if (state->engine == ENGINE_BITBOARD) bitboard_set(state, x, y, c);
+}
+
+// Wakes every cell of a chunk that holds something that moves.
+void seed_chunk(GameState* state, int cx, int cy) {
+    ChunkData* data = state->chunks[cy * state->chunks_x + cx].data;
+    for (int j = 0; j < CHUNK_SIZE; ++j) {
+        for (int i = 0; i < CHUNK_SIZE; ++i) {
+            switch (data->tiles[state->front][j * CHUNK_SIZE + i]) {
+                case 'O': case '$': case 'o': case 'S': case 'p': case 'i':
+                    wake_cell(state, cx * CHUNK_SIZE + i, cy * CHUNK_SIZE + j);
+                    break;
+                default:
+                    break;
+            }
+        }
+    }
+}
+
+// Only chunks with their own cells can hold anything that moves.
+void seed_active_cells(GameState* state) {
+    clear_awake_chunks(state);
+    for (int cy = 0; cy < state->chunks_y; ++cy) {
+        for (int cx = 0; cx < state->chunks_x; ++cx) {
+            ChunkData* data = state->chunks[cy * state->chunks_x + cx].data;
+            if (!data) continue;
+            memset(data->active, 0, sizeof(data->active));
+            data->active_count = 0;
+            seed_chunk(state, cx, cy);
+        }
+    }
+}
+
+// A chunk of a streamed level that is needed, either because something is written
+// into it or next to it, or because it is near the player, see stream_chunks().
+// It was left as it was in the file, so everything in it that moves is woken.
+ChunkData* page_in_chunk(GameState* state, int cx, int cy) {
+    ChunkData* data = materialize_chunk(state, &state->chunks[cy * state->chunks_x + cx]);
+    seed_chunk(state, cx, cy);
+    return data;
+}
+
+// Highest set bit below limit, -1 if there is none.
+int highest_bit_below(const uint64_t* bits, int limit) {
+    int last = limit - 1;
+    for (int w = last >> 6; w >= 0; --w) {
+        uint64_t word = bits[w];
+        if (w == last >> 6 && (last & 63) != 63) word &= (1ULL << ((last & 63) + 1)) - 1;
+        if (word) return w * 64 + 63 - __builtin_clzll(word);
+    }
+    return -1;
+}
+
+// The rows of row of chunks cy that the physics pass visits.
+static inline void band_rows(const GameState* state, int cy, int* bottom, int* top) {
+    *bottom = (cy + 1) * CHUNK_SIZE < state->height ? (cy + 1) * CHUNK_SIZE - 1 : state->height - 1;
+    *top = cy == 0 ? 1 : cy * CHUNK_SIZE;
+}
+
 void handle_player(GameState* state) {
     switch (state->key) {
     case 1:
-        switch (state->screen[state->pos_y - 1][state->pos_x]) {
+        switch (get_cell(state, state->pos_x, state->pos_y - 1)) {
             case '$':
                 state->gems_collected++; // fallthrough
             case ' ':
             case '.':
-                state->screen[state->pos_y][state->pos_x] = ' ';
-                state->screen[state->pos_y - 1][state->pos_x] = '@';
+                set_cell(state, state->pos_x, state->pos_y, ' ');
+                set_cell(state, state->pos_x, state->pos_y - 1, '@');
                 --state->pos_y;
                 break;
             case 'E':
@@ -110,13 +700,13 @@ void handle_player(GameState* state) {
         }
         break;
     case 2:
-        switch (state->screen[state->pos_y + 1][state->pos_x]) {
+        switch (get_cell(state, state->pos_x, state->pos_y + 1)) {
             case '$':
                 state->gems_collected++; // fallthrough
             case ' ':
             case '.':
-                state->screen[state->pos_y][state->pos_x] = ' ';
-                state->screen[state->pos_y + 1][state->pos_x] = '@';
+                set_cell(state, state->pos_x, state->pos_y, ' ');
+                set_cell(state, state->pos_x, state->pos_y + 1, '@');
                 ++state->pos_y;
                 break;
             case 'E':
@@ -127,23 +717,23 @@ void handle_player(GameState* state) {
         }
         break;
     case 3:
-        switch (state->screen[state->pos_y][state->pos_x + 1]) {
+        switch (get_cell(state, state->pos_x + 1, state->pos_y)) {
             case '$':
                 state->gems_collected++; // fallthrough
             case ' ':
             case '.':
-                state->screen[state->pos_y][state->pos_x] = ' ';
-                state->screen[state->pos_y][state->pos_x + 1] = '@';
+                set_cell(state, state->pos_x, state->pos_y, ' ');
+                set_cell(state, state->pos_x + 1, state->pos_y, '@');
                 ++state->pos_x;
                 break;
             case 'E':
                 state->won = 1;
                 break;
             case 'O':
-                if (state->screen[state->pos_y][state->pos_x + 2] == ' ') {
-                    state->screen[state->pos_y][state->pos_x + 2] = 'O';
-                    state->screen[state->pos_y][state->pos_x] = ' ';
-                    state->screen[state->pos_y][state->pos_x + 1] = '@';
+                if (get_cell(state, state->pos_x + 2, state->pos_y) == ' ') {
+                    set_cell(state, state->pos_x + 2, state->pos_y, 'O');
+                    set_cell(state, state->pos_x, state->pos_y, ' ');
+                    set_cell(state, state->pos_x + 1, state->pos_y, '@');
                     ++state->pos_x;
                 }
                 break;
@@ -152,23 +742,23 @@ void handle_player(GameState* state) {
         }
         break;
     case 4:
-        switch (state->screen[state->pos_y][state->pos_x - 1]) {
+        switch (get_cell(state, state->pos_x - 1, state->pos_y)) {
             case '$':
                 state->gems_collected++; // fallthrough
             case ' ':
             case '.':
-                state->screen[state->pos_y][state->pos_x] = ' ';
-                state->screen[state->pos_y][state->pos_x - 1] = '@';
+                set_cell(state, state->pos_x, state->pos_y, ' ');
+                set_cell(state, state->pos_x - 1, state->pos_y, '@');
                 --state->pos_x;
                 break;
             case 'E':
                 state->won = 1;
                 break;
             case 'O':
-                if (state->screen[state->pos_y][state->pos_x - 2] == ' ') {
-                    state->screen[state->pos_y][state->pos_x - 2] = 'O';
-                    state->screen[state->pos_y][state->pos_x] = ' ';
-                    state->screen[state->pos_y][state->pos_x - 1] = '@';
+                if (get_cell(state, state->pos_x - 2, state->pos_y) == ' ') {
+                    set_cell(state, state->pos_x - 2, state->pos_y, 'O');
+                    set_cell(state, state->pos_x, state->pos_y, ' ');
+                    set_cell(state, state->pos_x - 1, state->pos_y, '@');
                     --state->pos_x;
                 }
                 break;
@@ -182,265 +772,3122 @@ void handle_player(GameState* state) {
 }
 
 void handle_rocks_gems(GameState* state, int x, int y) {
-    int gem = state->screen[y][x] == '$';
-    if (state->screen[y + 1][x] == ' ') { // start to fall
+    int gem = get_cell(state, x, y) == '$';
+    if (get_cell(state, x, y + 1) == ' ') { // start to fall
         if (gem) {
-            state->screen[y][x] = 'S';
+            set_cell(state, x, y, 'S');
         } else {
-            state->screen[y][x] = 'o';
+            set_cell(state, x, y, 'o');
         }
         return;
     }
-    if (state->screen[y + 1][x] == 'O' || state->screen[y + 1][x] == '$') {
+    if (get_cell(state, x, y + 1) == 'O' || get_cell(state, x, y + 1) == '$') {
         // check left
-        if (state->screen[y][x - 1] == ' ' && state->screen[y + 1][x - 1] == ' ') {
+        if (get_cell(state, x - 1, y) == ' ' && get_cell(state, x - 1, y + 1) == ' ') {
             if (gem) {
-                state->screen[y][x] = 'S';
+                set_cell(state, x, y, 'S');
             } else {
-                state->screen[y][x] = 'o';
+                set_cell(state, x, y, 'o');
             }
         }
         // check right
-        if (state->screen[y][x + 1] == ' ' && state->screen[y + 1][x + 1] == ' ') {
+        if (get_cell(state, x + 1, y) == ' ' && get_cell(state, x + 1, y + 1) == ' ') {
             if (gem) {
-                state->screen[y][x] = 'S';
+                set_cell(state, x, y, 'S');
             } else {
-                state->screen[y][x] = 'o';
+                set_cell(state, x, y, 'o');
             }
         }
     }
 }
 
 void handle_falling_rocks_gems(GameState* state, int x, int y) {
-    int gem = state->screen[y][x] == 'S';
-    if (state->screen[y + 1][x] == ' ') {
-        state->screen[y][x] = ' ';
+    int gem = get_cell(state, x, y) == 'S';
+    if (get_cell(state, x, y + 1) == ' ') {
+        set_cell(state, x, y, ' ');
         if (gem) {
-            state->screen[y + 1][x] = 'S';
+            set_cell(state, x, y + 1, 'S');
         } else {
-            state->screen[y + 1][x] = 'o';
+            set_cell(state, x, y + 1, 'o');
         }
         return;
     }
-    if (state->screen[y + 1][x] == 'O' || state->screen[y + 1][x] == '$') {
+    if (get_cell(state, x, y + 1) == 'O' || get_cell(state, x, y + 1) == '$') {
         // check left
-        if (state->screen[y][x - 1] == ' ' && state->screen[y + 1][x - 1] == ' ') {
-            state->screen[y][x] = ' ';
+        if (get_cell(state, x - 1, y) == ' ' && get_cell(state, x - 1, y + 1) == ' ') {
+            set_cell(state, x, y, ' ');
             if (gem) {
-                state->screen[y][x - 1] = 'p';
+                set_cell(state, x - 1, y, 'p');
             } else {
-                state->screen[y][x - 1] = 'i';
+                set_cell(state, x - 1, y, 'i');
             }
             return;
         }
         // check right
-        if (state->screen[y][x + 1] == ' ' && state->screen[y + 1][x + 1] == ' ') {
-            state->screen[y][x] = ' ';
+        if (get_cell(state, x + 1, y) == ' ' && get_cell(state, x + 1, y + 1) == ' ') {
+            set_cell(state, x, y, ' ');
             if (gem) {
-                state->screen[y][x + 1] = 'S';
+                set_cell(state, x + 1, y, 'S');
             } else {
-                state->screen[y][x + 1] = 'o';
+                set_cell(state, x + 1, y, 'o');
             }
             return;
         }
     }
-    if (state->screen[y + 1][x] == 'o' || state->screen[y + 1][x] == 'S') return;
-    if (state->screen[y + 1][x] == '@') {
+    if (get_cell(state, x, y + 1) == 'o' || get_cell(state, x, y + 1) == 'S') return;
+    if (get_cell(state, x, y + 1) == '@') {
         state->dead = 1;
         return;
     }
     if (gem) {
-        state->screen[y][x] = '$';
+        set_cell(state, x, y, '$');
     } else {
-        state->screen[y][x] = 'O';
+        set_cell(state, x, y, 'O');
     }
 }
 
-void update_all_elements(GameState* state) {
-    // We iterate over the screen from bottom to top from right to left
-    for (int j = MAX_Y - 1; j != 0; --j) {
-        for (int i = MAX_X - 2; i != 0; --i) {
-            switch (state->screen[j][i]) {
-                case 'p':
-                    state->screen[j][i] = 'S';
-                    break;
-                case 'i':
-                    state->screen[j][i] = 'o';
-                    break;
-                case 'O':
-                case '$':
-                    handle_rocks_gems(state, i, j);
-                    break;
-                case 'o':
-                case 'S':
-                    handle_falling_rocks_gems(state, i, j);
-                    break;
-                default:
-                    break;
-            }
-        }
+void update_cell(GameState* state, int x, int y) {
+    switch (get_cell(state, x, y)) {
+        case 'p':
+            set_cell(state, x, y, 'S');
+            break;
+        case 'i':
+            set_cell(state, x, y, 'o');
+            break;
+        case 'O':
+        case '$':
+            handle_rocks_gems(state, x, y);
+            break;
+        case 'o':
+        case 'S':
+            handle_falling_rocks_gems(state, x, y);
+            break;
+        default:
+            break;
     }
 }
 
-void update(GameState* state) {
-    memcpy(state->screen, state->old_screen, sizeof(state->screen));
-    handle_player(state);
-    update_all_elements(state);
-    ++state->count;
+// The rules above only look at the cell, the cell below it and whether the
+// cells left, below-left, right and below-right are empty. physics_lut holds the
+// outcome of update_cell() for every such neighborhood, so the kernel can look it
+// up instead of walking the switches. Each entry is the new tile for the cell,
+// the left, right and below neighbors in 3 bits each (0 keeps the tile) and a
+// dead flag in bit 12. The table is generated by generate_physics_lut(), run
+// ./game --gen-lut after changing the rules and paste its output here.
+#define LUT_SIZE (7 * 5 * 16)
+#define LUT_DEAD (1 << 12)
+
+static const char lut_tiles[8] = { 0, ' ', 'O', '$', 'o', 'S', 'p', 'i' };
+
+static const unsigned char lut_self_class[256] = {
+    ['O'] = 1, ['$'] = 2, ['o'] = 3, ['S'] = 4, ['p'] = 5, ['i'] = 6
+};
+
+// 0 is everything the rules don't look for, e.g. walls and earth
+static const unsigned char lut_below_class[256] = {
+    [' '] = 1, ['O'] = 2, ['$'] = 2, ['o'] = 3, ['S'] = 3, ['@'] = 4
+};
+
+static const uint16_t physics_lut[LUT_SIZE] = {
+    0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000,
+    0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000,
+    0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000,
+    0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000,
+    0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000,
+    0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000,
+    0x0004, 0x0004, 0x0004, 0x0004, 0x0004, 0x0004, 0x0004, 0x0004, 0x0004, 0x0004, 0x0004, 0x0004, 0x0004, 0x0004, 0x0004, 0x0004,
+    0x0000, 0x0000, 0x0000, 0x0004, 0x0000, 0x0000, 0x0000, 0x0004, 0x0000, 0x0000, 0x0000, 0x0004, 0x0004, 0x0004, 0x0004, 0x0004,
+    0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000,
+    0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000,
+    0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000,
+    0x0005, 0x0005, 0x0005, 0x0005, 0x0005, 0x0005, 0x0005, 0x0005, 0x0005, 0x0005, 0x0005, 0x0005, 0x0005, 0x0005, 0x0005, 0x0005,
+    0x0000, 0x0000, 0x0000, 0x0005, 0x0000, 0x0000, 0x0000, 0x0005, 0x0000, 0x0000, 0x0000, 0x0005, 0x0005, 0x0005, 0x0005, 0x0005,
+    0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000,
+    0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000,
+    0x0002, 0x0002, 0x0002, 0x0002, 0x0002, 0x0002, 0x0002, 0x0002, 0x0002, 0x0002, 0x0002, 0x0002, 0x0002, 0x0002, 0x0002, 0x0002,
+    0x0801, 0x0801, 0x0801, 0x0801, 0x0801, 0x0801, 0x0801, 0x0801, 0x0801, 0x0801, 0x0801, 0x0801, 0x0801, 0x0801, 0x0801, 0x0801,
+    0x0002, 0x0002, 0x0002, 0x0101, 0x0002, 0x0002, 0x0002, 0x0101, 0x0002, 0x0002, 0x0002, 0x0101, 0x0039, 0x0039, 0x0039, 0x0039,
+    0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000,
+    0x1000, 0x1000, 0x1000, 0x1000, 0x1000, 0x1000, 0x1000, 0x1000, 0x1000, 0x1000, 0x1000, 0x1000, 0x1000, 0x1000, 0x1000, 0x1000,
+    0x0003, 0x0003, 0x0003, 0x0003, 0x0003, 0x0003, 0x0003, 0x0003, 0x0003, 0x0003, 0x0003, 0x0003, 0x0003, 0x0003, 0x0003, 0x0003,
+    0x0a01, 0x0a01, 0x0a01, 0x0a01, 0x0a01, 0x0a01, 0x0a01, 0x0a01, 0x0a01, 0x0a01, 0x0a01, 0x0a01, 0x0a01, 0x0a01, 0x0a01, 0x0a01,
+    0x0003, 0x0003, 0x0003, 0x0141, 0x0003, 0x0003, 0x0003, 0x0141, 0x0003, 0x0003, 0x0003, 0x0141, 0x0031, 0x0031, 0x0031, 0x0031,
+    0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000,
+    0x1000, 0x1000, 0x1000, 0x1000, 0x1000, 0x1000, 0x1000, 0x1000, 0x1000, 0x1000, 0x1000, 0x1000, 0x1000, 0x1000, 0x1000, 0x1000,
+    0x0005, 0x0005, 0x0005, 0x0005, 0x0005, 0x0005, 0x0005, 0x0005, 0x0005, 0x0005, 0x0005, 0x0005, 0x0005, 0x0005, 0x0005, 0x0005,
+    0x0005, 0x0005, 0x0005, 0x0005, 0x0005, 0x0005, 0x0005, 0x0005, 0x0005, 0x0005, 0x0005, 0x0005, 0x0005, 0x0005, 0x0005, 0x0005,
+    0x0005, 0x0005, 0x0005, 0x0005, 0x0005, 0x0005, 0x0005, 0x0005, 0x0005, 0x0005, 0x0005, 0x0005, 0x0005, 0x0005, 0x0005, 0x0005,
+    0x0005, 0x0005, 0x0005, 0x0005, 0x0005, 0x0005, 0x0005, 0x0005, 0x0005, 0x0005, 0x0005, 0x0005, 0x0005, 0x0005, 0x0005, 0x0005,
+    0x0005, 0x0005, 0x0005, 0x0005, 0x0005, 0x0005, 0x0005, 0x0005, 0x0005, 0x0005, 0x0005, 0x0005, 0x0005, 0x0005, 0x0005, 0x0005,
+    0x0004, 0x0004, 0x0004, 0x0004, 0x0004, 0x0004, 0x0004, 0x0004, 0x0004, 0x0004, 0x0004, 0x0004, 0x0004, 0x0004, 0x0004, 0x0004,
+    0x0004, 0x0004, 0x0004, 0x0004, 0x0004, 0x0004, 0x0004, 0x0004, 0x0004, 0x0004, 0x0004, 0x0004, 0x0004, 0x0004, 0x0004, 0x0004,
+    0x0004, 0x0004, 0x0004, 0x0004, 0x0004, 0x0004, 0x0004, 0x0004, 0x0004, 0x0004, 0x0004, 0x0004, 0x0004, 0x0004, 0x0004, 0x0004,
+    0x0004, 0x0004, 0x0004, 0x0004, 0x0004, 0x0004, 0x0004, 0x0004, 0x0004, 0x0004, 0x0004, 0x0004, 0x0004, 0x0004, 0x0004, 0x0004,
+    0x0004, 0x0004, 0x0004, 0x0004, 0x0004, 0x0004, 0x0004, 0x0004, 0x0004, 0x0004, 0x0004, 0x0004, 0x0004, 0x0004, 0x0004, 0x0004,
+};
+
+static inline int lut_index(char self, char below, char left, char below_left, char right, char below_right) {
+    return (lut_self_class[(unsigned char)self] * 5 + lut_below_class[(unsigned char)below]) << 4
+        | (left == ' ') << 3 | (below_left == ' ') << 2 | (right == ' ') << 1 | (below_right == ' ');
 }
 
-void render(GameState* state) {
-    for (int j = 0; j < MAX_Y; ++j) {
-        for (int i = 0; i < MAX_X; ++i) {
-            char c = state->screen[j][i];
-            if (c == '$' || c == 'S') {
-                int l = ((state->count + 5 * j + 7 * i) % 16) / 8;
-                printf("\e[%d;%dH", j + 1, i + 1); // move cursor
-                if (l == 0) {
-                    printf("\e[48;2;10;10;40m\e[38;2;153;51;255m$");
-                } else {
-                    printf("\e[48;2;10;10;40m\e[38;12;33;61;255m$");
-                }
-                continue;
-            }
-            if (state->old_screen[j][i] != state->screen[j][i]) {
-                printf("\e[%d;%dH", j + 1, i + 1); // move cursor
-                switch (c) {
-                case '\n':
-                    printf("\n");
-                    break;
-                case 'X':
-                    printf("\e[48;2;51;51;81m\e[38;2;91;91;91mX");
-                    break;
-                case '.':
-                    printf("\e[48;2;80;76;60m\e[38;2;51;0;25m ");
-                    break;
-                case ' ':
-                    printf("\e[48;2;10;10;40m ");
-                    break;
-                case 'O':
-                    printf("\e[48;2;10;10;40m\e[38;2;202;198;194mO");
-                    break;
-                case 'o':
-                    printf("\e[48;2;10;10;40m\e[38;2;202;198;194mo");
-                    break;
-                case '@':
-                    printf("\e[48;2;10;10;40m\e[38;2;235;51;51m@");
-                    break;
-                case 'E':
-                    printf("\e[48;2;10;10;40m\e[38;2;251;251;15mE");
-                default:
-                    break;
-                }
-            }
-        }
+void update_cell_lut(GameState* state, int x, int y) {
+    const ChunkData* data = chunk_at(state, x, y)->data;
+    int local_x = x & CHUNK_MASK;
+    uint16_t entry;
+    if (local_x != 0 && local_x != CHUNK_MASK && (y & CHUNK_MASK) != CHUNK_MASK) {
+        // the whole neighborhood is in this chunk; active cells never are in a uniform one
+        const char* row = &data->tiles[state->front][chunk_cell(x, y)];
+        const char* under = row + CHUNK_SIZE;
+        entry = physics_lut[lut_index(row[0], under[0], row[-1], under[-1], row[1], under[1])];
+    } else {
+        entry = physics_lut[lut_index(get_cell(state, x, y), get_cell(state, x, y + 1), get_cell(state, x - 1, y),
+            get_cell(state, x - 1, y + 1), get_cell(state, x + 1, y), get_cell(state, x + 1, y + 1))];
     }
-    fflush(stdout);
+    state->dead |= (entry & LUT_DEAD) != 0;
+    if (!(entry & ~LUT_DEAD)) return;
+    char c;
+    if ((c = lut_tiles[entry & 7])) set_cell(state, x, y, c);
+    if ((c = lut_tiles[(entry >> 3) & 7])) set_cell(state, x - 1, y, c);
+    if ((c = lut_tiles[(entry >> 6) & 7])) set_cell(state, x + 1, y, c);
+    if ((c = lut_tiles[(entry >> 9) & 7])) set_cell(state, x, y + 1, c);
 }
 
-void find_player_position(GameState* state) {
-    for (int j = 0; j < MAX_Y; ++j) {
-        for (int i = 0; i < MAX_X; ++i) {
-            if (state->screen[j][i] == '@') {
-                state->pos_x = i;
-                state->pos_y = j;
-                return;
-            }
-        }
+int lut_tile_code(char c) {
+    for (int k = 1; k < 8; ++k) {
+        if (lut_tiles[k] == c) return k;
     }
+    return 0;
 }
 
-void load_level(GameState* state) {
-    FILE* f = fopen("./level_1.txt", "r");
-    if (!f) {
-        fprintf(stderr, "Failed to open level_1.txt");
-        exit(EXIT_FAILURE);
+// Builds every neighborhood on a scratch board and records what update_cell() does.
+void generate_physics_lut(uint16_t lut[LUT_SIZE]) {
+    static const char selves[7] = { 'X', 'O', '$', 'o', 'S', 'p', 'i' };
+    static const char belows[5] = { 'X', ' ', 'O', 'o', '@' };
+    for (int index = 0; index < LUT_SIZE; ++index) {
+        GameState scratch = {};
+        init_game_state(&scratch, 3, 3);
+        char tiles[9] = {}; // cell (x, y) is tiles[y * 3 + x]
+        tiles[4] = selves[index / 80];
+        tiles[7] = belows[(index >> 4) % 5];
+        tiles[3] = index & 8 ? ' ' : 'X';
+        tiles[6] = index & 4 ? ' ' : 'X';
+        tiles[5] = index & 2 ? ' ' : 'X';
+        tiles[8] = index & 1 ? ' ' : 'X';
+        load_board(&scratch, tiles);
+        char before[4] = { tiles[4], tiles[3], tiles[5], tiles[7] };
+
+        update_cell(&scratch, 1, 1);
+
+        char after[4] = { get_cell(&scratch, 1, 1), get_cell(&scratch, 0, 1), get_cell(&scratch, 2, 1), get_cell(&scratch, 1, 2) };
+        uint16_t entry = scratch.dead ? LUT_DEAD : 0;
+        for (int k = 0; k < 4; ++k) {
+            if (after[k] != before[k]) entry |= lut_tile_code(after[k]) << (3 * k);
+        }
+        lut[index] = entry;
+        free_game_state(&scratch);
     }
-    if (fread(state->screen, 1, MAX_X * MAX_Y, f) != MAX_X * MAX_Y) {
-        fprintf(stderr, "Failed to read level_1.txt");
-        fclose(f);
-        exit(EXIT_FAILURE);
+}
+
+void print_physics_lut() {
+    uint16_t lut[LUT_SIZE];
+    generate_physics_lut(lut);
+    for (int index = 0; index < LUT_SIZE; index += 16) {
+        printf("   ");
+        for (int k = index; k < index + 16; ++k) printf(" 0x%04x,", lut[k]);
+        printf("\n");
     }
-    render(state); // To display the level
-    find_player_position(state);
-    memcpy(state->old_screen, state->screen, sizeof(state->screen));
-    fclose(f);
 }
 
-void print_end_message(GameState* state) {
-    printf("\e[%d;%dH", MAX_Y + 2, 1); // move cursor
-    if (state->dead) {
-        printf("You died! Better luck next time!");
+// Where update_all_elements() continues a pass that was stopped by its budget:
+// the next cell to look at is in row of chunks scan_cy, row scan_y, left of column scan_x.
+void start_scan(GameState* state) {
+    state->scan_cy = highest_bit_below(state->awake_bands, state->chunks_y);
+    int top;
+    if (state->scan_cy >= 0) band_rows(state, state->scan_cy, &state->scan_y, &top);
+    state->scan_x = state->width;
+}
+
+// The clock is only read every 64 cells.
+static inline int out_of_budget(long visited, long max_cells, const struct timespec* deadline) {
+    if (max_cells && visited == max_cells) return 1;
+    if (!deadline || (visited & 63) != 63) return 0;
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec > deadline->tv_sec || (now.tv_sec == deadline->tv_sec && now.tv_nsec >= deadline->tv_nsec);
+}
+
+// Carries on with the pass started by start_scan() and returns 1 once it is done,
+// or 0 when it stopped after max_cells cells or max_ns nanoseconds (0 for no limit).
+int update_all_elements_until(GameState* state, long max_cells, long max_ns) {
+    // We iterate over the active cells from bottom to top from right to left.
+    // Cells woken ahead of the scan are handled in this pass, exactly where the
+    // full scan would have reached them. Cells woken behind it wait for the next tick.
+    // Rows of chunks without an awake chunk are skipped. Within the others, each
+    // row only visits the awake chunks, read again for every chunk, as handling
+    // a cell can wake the chunk left of it, or the row of chunks above.
+    // Everything is read again from the cursor, so a pass can stop before any
+    // cell and go on later as if it never stopped, as long as nothing else writes
+    // to the board in between.
+    struct timespec deadline = {};
+    if (max_ns) {
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        deadline.tv_sec += (deadline.tv_nsec + max_ns) / 1000000000;
+        deadline.tv_nsec = (deadline.tv_nsec + max_ns) % 1000000000;
     }
-    if (state->won) {
-        printf("You won! You collected %d gems!", state->gems_collected);
+    long visited = 0;
+    int cy = state->scan_cy, j = state->scan_y, x = state->scan_x;
+    while (cy >= 0) {
+        uint64_t* band = &state->awake_chunks[(size_t)cy * state->chunk_words];
+        int bottom, top;
+        band_rows(state, cy, &bottom, &top);
+        for (; j >= top; --j, x = state->width) {
+            int cx;
+            while ((cx = highest_bit_below(band, (x + CHUNK_MASK) >> CHUNK_SHIFT)) >= 0) {
+                ChunkData* data = state->chunks[cy * state->chunks_x + cx].data;
+                uint32_t* row = &data->active[j & CHUNK_MASK];
+                uint32_t bits;
+                int i = x - cx * CHUNK_SIZE < CHUNK_SIZE ? x - cx * CHUNK_SIZE : CHUNK_SIZE;
+                while ((bits = *row & (uint32_t)((1ULL << i) - 1))) {
+                    if (out_of_budget(visited, max_cells, max_ns ? &deadline : NULL)) {
+                        state->scan_cy = cy;
+                        state->scan_y = j;
+                        state->scan_x = cx * CHUNK_SIZE + i;
+                        return 0;
+                    }
+                    i = 31 - __builtin_clz(bits);
+                    *row &= ~(1u << i);
+                    --data->active_count;
+                    ++visited;
+                    if (state->engine == ENGINE_LUT) {
+                        update_cell_lut(state, cx * CHUNK_SIZE + i, j);
+                    } else {
+                        update_cell(state, cx * CHUNK_SIZE + i, j);
+                    }
+                }
+                if (data->active_count == 0) sleep_chunk(state, cx, cy);
+                x = cx * CHUNK_SIZE;
+            }
+        }
+        cy = highest_bit_below(state->awake_bands, cy);
+        if (cy >= 0) band_rows(state, cy, &j, &top);
     }
+    state->scan_cy = -1;
+    return 1;
 }
 
-// Lower is faster
-#define SPEED 0.1
+void update_all_elements(GameState* state) {
+    start_scan(state);
+    update_all_elements_until(state, 0, 0);
+}
 
-#ifndef RUN_TESTS
+void build_bitboard(GameState* state) {
+    memset(state->planes.rest, 0, sizeof(uint64_t) * 5 * state->row_words * (state->height + 1));
+    for (int j = 0; j < state->height; ++j) {
+        for (int i = 0; i < state->width; ++i) {
+            bitboard_set(state, i, j, get_cell(state, i, j));
+        }
+    }
+}
 
-int main() {
-    configure_terminal();
+// Row x of a plane as seen from the neighbor column: at_left(p)[x] is p[x - 1],
+// at_right(p)[x] is p[x + 1].
+static inline uint64_t at_left(const uint64_t* p, int w) {
+    return (p[w] << 1) | (w > 0 ? p[w - 1] >> 63 : 0);
+}
 
-    signal(SIGINT, signal_handler);
+static inline uint64_t at_right(const uint64_t* p, int w, int words) {
+    return (p[w] >> 1) | (w + 1 < words ? p[w + 1] << 63 : 0);
+}
 
-    struct timespec req = {};
-    struct timespec rem = {};
+// Columns 1 to width - 2, the ones the scan visits.
+static inline uint64_t inner_columns(int w, int width) {
+    uint64_t mask = ~0ULL;
+    if (w == 0) mask &= ~1ULL;
+    int last = width - 2 - w * 64;
+    if (last < 63) mask &= last < 0 ? 0 : (1ULL << (last + 1)) - 1;
+    return mask;
+}
 
-    GameState state = {
-        .pos_x = 5,
-        .pos_y = 5
-    };
+void write_bits(GameState* state, int y, int w, uint64_t bits, char rock, char gem, const uint64_t* gems) {
+    while (bits) {
+        int b = __builtin_ctzll(bits);
+        bits &= bits - 1;
+        set_cell(state, w * 64 + b, y, (gems[w] >> b) & 1 ? gem : rock);
+    }
+}
 
-    printf("\e[2J");
-    load_level(&state);
+// Same rules as handle_rocks_gems() and handle_falling_rocks_gems(), for a whole
+// row at once. Rows still go bottom to top, and the order within a row works
+// out as follows: when the cell at x is handled, the cells right of it are done
+// and the ones left of it are not. A cell x + 1 that was empty before the row is
+// still empty then, unless x + 2 has just rolled left into it. Cells that were
+// not empty either stay full or were left by an object that now fills the cell
+// below them, which fails the "both empty" check anyway. So every test only
+// needs the row as it was, the row below as it is now and the roll-left targets.
+// Objects rolling left land as falling right away, the p/i markers are not needed.
+//
+// words is the row length in 64 bit words. It is a constant in the kernels
+// below, so the word loops unroll and the row temporaries become plain arrays.
+static inline __attribute__((always_inline)) void bitboard_row(GameState* state, int j, const int words) {
+    BitBoard* planes = &state->planes;
+    size_t row = (size_t)j * words;
+    size_t below = row + words;
+    int has_objects = 0;
+    for (int w = 0; w < words; ++w) has_objects |= (planes->rest[row + w] | planes->fall[row + w]) != 0;
+    if (!has_objects) return;
 
-    clock_t start, end;
+    const uint64_t* R = &planes->rest[row];
+    const uint64_t* F = &planes->fall[row];
+    const uint64_t* E = &planes->empty[row];
+    const uint64_t* BR = &planes->rest[below];
+    const uint64_t* BF = &planes->fall[below];
+    const uint64_t* BE = &planes->empty[below];
+    const uint64_t* BP = &planes->player[below];
+    int width = state->width;
 
-    while (!exit_loop) {
-        start = clock();
+    uint64_t on_rest[words]; // falling objects sitting on a rock or gem
+    uint64_t left_target[words]; // empty cells a falling object rolls left into
+    uint64_t right_free[words]; // empty after left rolls, with an empty cell below
+    for (int w = 0; w < words; ++w) on_rest[w] = F[w] & BR[w] & inner_columns(w, width);
+    for (int w = 0; w < words; ++w) left_target[w] = at_right(on_rest, w, words) & E[w] & BE[w];
+    for (int w = 0; w < words; ++w) right_free[w] = E[w] & ~left_target[w] & BE[w];
 
-        read_input(&state);
-        update(&state);
-        if (state.won || state.dead) {
-            print_end_message(&state);
-            break;
-        }
+    uint64_t fall_down[words], roll_left[words], roll_right[words];
+    uint64_t land[words], start_fall[words], gems[words];
+    for (int w = 0; w < words; ++w) {
+        uint64_t inner = inner_columns(w, width);
+        uint64_t can_left = at_left(E, w) & at_left(BE, w);
+        uint64_t can_right = at_right(right_free, w, words);
+        fall_down[w] = F[w] & BE[w] & inner;
+        roll_left[w] = on_rest[w] & can_left;
+        roll_right[w] = on_rest[w] & ~can_left & can_right;
+        land[w] = F[w] & inner & ~BE[w] & ~BF[w] & ~BP[w] & ~(BR[w] & (can_left | can_right));
+        start_fall[w] = R[w] & inner & (BE[w] | (BR[w] & (can_left | can_right)));
+        if (F[w] & BP[w] & inner) state->dead = 1;
+        gems[w] = planes->gem[row + w];
+    }
 
-        render(&state);
+    // the objects rolling sideways take their gem bit along
+    uint64_t moved_left_gems[words], moved_right_gems[words];
+    uint64_t right_target[words], target_gems[words];
+    for (int w = 0; w < words; ++w) {
+        moved_left_gems[w] = gems[w] & roll_left[w];
+        moved_right_gems[w] = gems[w] & roll_right[w];
+    }
+    for (int w = 0; w < words; ++w) {
+        right_target[w] = at_left(roll_right, w);
+        target_gems[w] = at_right(moved_left_gems, w, words) | at_left(moved_right_gems, w);
+    }
 
-        memcpy(state.old_screen, state.screen, sizeof(state.screen));
+    for (int w = 0; w < words; ++w) {
+        write_bits(state, j, w, start_fall[w], 'o', 'S', gems);
+        write_bits(state, j, w, land[w], 'O', '$', gems);
+        write_bits(state, j + 1, w, fall_down[w], 'o', 'S', gems);
+        write_bits(state, j, w, fall_down[w] | roll_left[w] | roll_right[w], ' ', ' ', gems);
+        write_bits(state, j, w, left_target[w] | right_target[w], 'o', 'S', target_gems);
+    }
+}
 
-        end = clock();
+// Specialized kernels for the common row lengths, up to 64, 128 and 256 columns.
+#define DEFINE_BITBOARD_ROW_KERNEL(WORDS) \
+    static void bitboard_row_##WORDS(GameState* state, int j) { \
+        bitboard_row(state, j, WORDS); \
+    }
 
-        double time_taken = ((double)(end - start)) / CLOCKS_PER_SEC;
-        if (time_taken > SPEED) continue;
+DEFINE_BITBOARD_ROW_KERNEL(1)
+DEFINE_BITBOARD_ROW_KERNEL(2)
+DEFINE_BITBOARD_ROW_KERNEL(4)
 
-        req.tv_sec = 0;
-        req.tv_nsec = (SPEED - time_taken) * 1000000000; // 0.1 seconds
-        nanosleep(&req, &rem);
+static void bitboard_row_any(GameState* state, int j) {
+    bitboard_row(state, j, state->row_words);
+}
+
+// Clears the active cells of row j and tells if there were any. The kernels do
+// whole rows, so a row is either handled with all of its cells or skipped. Cells
+// the row wakes in itself stay marked, even the ones the scan would have handled
+// in this pass, which at worst has the row handled once more for nothing.
+int take_active_row(GameState* state, int cy, int j) {
+    uint64_t* band = &state->awake_chunks[(size_t)cy * state->chunk_words];
+    int any = 0;
+    int cx = state->chunks_x;
+    while ((cx = highest_bit_below(band, cx)) >= 0) {
+        ChunkData* data = state->chunks[cy * state->chunks_x + cx].data;
+        uint32_t* row = &data->active[j & CHUNK_MASK];
+        if (!*row) continue;
+        any = 1;
+        data->active_count -= __builtin_popcount(*row);
+        *row = 0;
+        if (data->active_count == 0) sleep_chunk(state, cx, cy);
     }
+    return any;
 }
 
-#endif
+void update_all_elements_bitboard(GameState* state) {
+    void (*kernel)(GameState*, int);
+    switch (state->row_words) {
+        case 1: kernel = bitboard_row_1; break;
+        case 2: kernel = bitboard_row_2; break;
+        case 4: kernel = bitboard_row_4; break;
+        default: kernel = bitboard_row_any; break;
+    }
+    // A row without active cells is one the scan would not touch.
+    int cy = state->chunks_y;
+    while ((cy = highest_bit_below(state->awake_bands, cy)) >= 0) {
+        int bottom, top;
+        band_rows(state, cy, &bottom, &top);
+        for (int j = bottom; j >= top; --j) {
+            if (take_active_row(state, cy, j)) kernel(state, j);
+        }
+    }
+}
 
-#ifdef RUN_TESTS
+// ENGINE_TWO_BUFFER
+// Every object decides what to do by looking at the board as it was when the
+// physics pass started, and the next board is built from those decisions. No cell
+// sees another cell's update of the same tick, so rows can be computed in any
+// order. The outcome differs from the scan: e.g. a rock resting on a rock that
+// only starts falling in this tick waits a tick longer before it follows.
+//
+// Two objects can want the same empty cell. The one falling straight down into
+// it gets it, then the one rolling in from the right, then the one from the left.
+// Objects that lose stay where they are, still falling, and try again next tick.
+enum {
+    INTENT_STAY,
+    INTENT_START_FALL,
+    INTENT_DOWN,
+    INTENT_LEFT,
+    INTENT_RIGHT,
+    INTENT_LAND,
+};
 
-int test_player_lives() {
-    GameState state = {
-        .old_screen = {
-                {'X', 'X', 'X', 'X', '\n'},
-                {'X', 'O', 'O', 'X', '\n'},
-                {'X', '@', '.', 'X', '\n'},
-                {'X', 'X', 'X', 'X', '\n'}
-            },
-        .key = 3,
-        .pos_x = 1,
-        .pos_y = 2,
+// Reads state->screen only, which holds the previous board during the pass.
+int intent(const GameState* state, int x, int y) {
+    // same cells as the scan visits
+    if (x < 1 || x > state->width - 2 || y < 1 || y > state->height - 1) return INTENT_STAY;
+    char c = get_cell(state, x, y);
+    int resting = c == 'O' || c == '$';
+    if (!resting && c != 'o' && c != 'S') return INTENT_STAY;
+
+    char below = get_cell(state, x, y + 1);
+    int can_left = get_cell(state, x - 1, y) == ' ' && get_cell(state, x - 1, y + 1) == ' ';
+    int can_right = get_cell(state, x + 1, y) == ' ' && get_cell(state, x + 1, y + 1) == ' ';
+    if (resting) {
+        if (below == ' ' || ((below == 'O' || below == '$') && (can_left || can_right))) return INTENT_START_FALL;
+        return INTENT_STAY;
+    }
+    switch (below) {
+        case ' ': return INTENT_DOWN;
+        case 'O':
+        case '$':
+            if (can_left) return INTENT_LEFT;
+            if (can_right) return INTENT_RIGHT;
+            return INTENT_LAND;
+        case 'o':
+        case 'S':
+        case '@':
+            return INTENT_STAY;
+        default:
+            return INTENT_LAND;
+    }
+}
+
+static inline char falling_tile(char c) {
+    return c == '$' || c == 'S' ? 'S' : 'o';
+}
+
+static inline char resting_tile(char c) {
+    return c == '$' || c == 'S' ? '$' : 'O';
+}
+
+char next_tile(const GameState* state, int x, int y) {
+    char c = get_cell(state, x, y);
+    switch (c) {
+        case 'O':
+        case '$':
+            return intent(state, x, y) == INTENT_START_FALL ? falling_tile(c) : c;
+        case 'o':
+        case 'S':
+            switch (intent(state, x, y)) {
+                case INTENT_DOWN:
+                    return ' ';
+                case INTENT_LEFT:
+                    return intent(state, x - 1, y - 1) == INTENT_DOWN ? c : ' ';
+                case INTENT_RIGHT:
+                    if (intent(state, x + 1, y - 1) == INTENT_DOWN) return c;
+                    if (intent(state, x + 2, y) == INTENT_LEFT) return c;
+                    return ' ';
+                case INTENT_LAND:
+                    return resting_tile(c);
+                default:
+                    return c;
+            }
+        case ' ':
+            if (intent(state, x, y - 1) == INTENT_DOWN) return falling_tile(get_cell(state, x, y - 1));
+            if (intent(state, x + 1, y) == INTENT_LEFT) return falling_tile(get_cell(state, x + 1, y));
+            if (intent(state, x - 1, y) == INTENT_RIGHT) return falling_tile(get_cell(state, x - 1, y));
+            return ' ';
+        default:
+            return c;
+    }
+}
+
+// Computes cells x0 to x1 - 1 of row y of the next board and appends the ones that change.
+// Returns 1 if a falling object is sitting on the player.
+int propose_cells(const GameState* state, int y, int x0, int x1, CellChange* changes, int* count) {
+    int dead = 0;
+    for (int x = x0; x < x1; ++x) {
+        char c = get_cell(state, x, y);
+        char next = next_tile(state, x, y);
+        if (next != c) changes[(*count)++] = (CellChange){ x, y, next };
+        if ((c == 'o' || c == 'S') && x >= 1 && x <= state->width - 2 && get_cell(state, x, y + 1) == '@') dead = 1;
+    }
+    return dead;
+}
+
+// Only what is next to an awake chunk is computed. An object can only move if
+// one of its cells was active, and intent() only changes when a neighbor does.
+// What it does reaches two columns left of it and one row down, so a chunk with
+// no awake neighbor comes out as it is. Every cell of the awake chunks is looked
+// at, so their active cells are used up here, the changes wake the next ones.
+void plan_proposals(GameState* state) {
+    int cy = state->chunks_y;
+    while ((cy = highest_bit_below(state->proposed_bands, cy)) >= 0) {
+        memset(&state->proposed_chunks[(size_t)cy * state->chunk_words], 0, sizeof(uint64_t) * state->chunk_words);
+        state->proposed_bands[cy >> 6] &= ~(1ULL << (cy & 63));
+    }
+    cy = state->chunks_y;
+    while ((cy = highest_bit_below(state->awake_bands, cy)) >= 0) {
+        uint64_t* band = &state->awake_chunks[(size_t)cy * state->chunk_words];
+        int cx = state->chunks_x;
+        while ((cx = highest_bit_below(band, cx)) >= 0) {
+            for (int j = cy - 1; j <= cy + 1; ++j) {
+                if (j < 0 || j >= state->chunks_y) continue;
+                for (int i = cx - 1; i <= cx + 1; ++i) {
+                    if (i < 0 || i >= state->chunks_x) continue;
+                    state->proposed_chunks[(size_t)j * state->chunk_words + (i >> 6)] |= 1ULL << (i & 63);
+                }
+                state->proposed_bands[j >> 6] |= 1ULL << (j & 63);
+            }
+            ChunkData* data = state->chunks[cy * state->chunks_x + cx].data;
+            memset(data->active, 0, sizeof(data->active));
+            data->active_count = 0;
+        }
+        memset(band, 0, sizeof(uint64_t) * state->chunk_words);
+        state->awake_bands[cy >> 6] &= ~(1ULL << (cy & 63));
+    }
+}
+
+// Computes the chunks of row y planned for this pass, see propose_cells().
+int propose_row(const GameState* state, int y, CellChange* changes, int* count) {
+    const uint64_t* band = &state->proposed_chunks[(size_t)(y >> CHUNK_SHIFT) * state->chunk_words];
+    int dead = 0;
+    for (int w = 0; w < state->chunk_words; ++w) {
+        for (uint64_t bits = band[w]; bits; bits &= bits - 1) {
+            int x0 = (w * 64 + __builtin_ctzll(bits)) * CHUNK_SIZE;
+            int x1 = x0 + CHUNK_SIZE < state->width ? x0 + CHUNK_SIZE : state->width;
+            dead |= propose_cells(state, y, x0, x1, changes, count);
+        }
+    }
+    return dead;
+}
+
+// A horizontal band of rows, proposed by one thread.
+typedef struct {
+    int first;
+    int last;
+    int dead;
+    int change_count;
+    CellChange* changes;
+} Stripe;
+
+// Persistent threads for ENGINE_TWO_BUFFER. The calling thread proposes the first
+// stripe, each worker one of the others. The board is only read while stripes are
+// proposed, so the rows just outside a stripe (its halo) are read in place from
+// the shared board instead of being copied between threads. The changes are
+// applied afterwards on the calling thread, stripe by stripe, which gives the
+// same board as proposing everything on one thread.
+struct WorkerPool {
+    int threads;
+    int quit;
+    GameState* state;
+    pthread_t* workers;
+    Stripe* stripes;
+    pthread_barrier_t start;
+    pthread_barrier_t done;
+};
+
+void propose_stripe(GameState* state, Stripe* stripe) {
+    stripe->dead = 0;
+    stripe->change_count = 0;
+    for (int j = stripe->first; j < stripe->last; ++j) {
+        int cy = j >> CHUNK_SHIFT;
+        if (!(state->proposed_bands[cy >> 6] & (1ULL << (cy & 63)))) {
+            j |= CHUNK_MASK; // on to the next row of chunks
+            continue;
+        }
+        stripe->dead |= propose_row(state, j, stripe->changes, &stripe->change_count);
+    }
+}
+
+void apply_stripe(GameState* state, const Stripe* stripe) {
+    if (stripe->dead) state->dead = 1;
+    for (int k = 0; k < stripe->change_count; ++k) {
+        set_cell(state, stripe->changes[k].x, stripe->changes[k].y, stripe->changes[k].c);
+    }
+}
+
+typedef struct {
+    WorkerPool* pool;
+    int index;
+} WorkerArgs;
+
+void* worker_main(void* arg) {
+    WorkerArgs args = *(WorkerArgs*)arg;
+    free(arg);
+    for (;;) {
+        pthread_barrier_wait(&args.pool->start);
+        if (args.pool->quit) break;
+        propose_stripe(args.pool->state, &args.pool->stripes[args.index]);
+        pthread_barrier_wait(&args.pool->done);
+    }
+    return NULL;
+}
+
+// The stripes are fixed for a board size, boards of another size need their own pool.
+WorkerPool* start_worker_pool(int threads, int width, int height) {
+    int rows = height - 1; // rows 1 to height - 1 are updated
+    if (threads > rows) threads = rows;
+    if (threads < 1) threads = 1;
+
+    WorkerPool* pool = allocate(1, sizeof(WorkerPool));
+    pool->threads = threads;
+    pool->stripes = allocate(threads, sizeof(Stripe));
+    pool->workers = allocate(threads, sizeof(pthread_t));
+    for (int k = 0; k < threads; ++k) {
+        pool->stripes[k].first = 1 + rows * k / threads;
+        pool->stripes[k].last = 1 + rows * (k + 1) / threads;
+        pool->stripes[k].changes = allocate((size_t)width * (pool->stripes[k].last - pool->stripes[k].first), sizeof(CellChange));
+    }
+    pthread_barrier_init(&pool->start, NULL, threads);
+    pthread_barrier_init(&pool->done, NULL, threads);
+    for (int k = 1; k < threads; ++k) {
+        WorkerArgs* args = allocate(1, sizeof(WorkerArgs));
+        *args = (WorkerArgs){ pool, k };
+        pthread_create(&pool->workers[k], NULL, worker_main, args);
+    }
+    return pool;
+}
+
+void stop_worker_pool(WorkerPool* pool) {
+    if (!pool) return;
+    pool->quit = 1;
+    pthread_barrier_wait(&pool->start);
+    for (int k = 1; k < pool->threads; ++k) pthread_join(pool->workers[k], NULL);
+    pthread_barrier_destroy(&pool->start);
+    pthread_barrier_destroy(&pool->done);
+    for (int k = 0; k < pool->threads; ++k) free(pool->stripes[k].changes);
+    free(pool->stripes);
+    free(pool->workers);
+    free(pool);
+}
+
+void update_all_elements_two_buffer(GameState* state) {
+    plan_proposals(state);
+    WorkerPool* pool = state->pool;
+    if (!pool || pool->threads == 1) {
+        Stripe all = { .first = 1, .last = state->height, .changes = state->changes };
+        propose_stripe(state, &all);
+        apply_stripe(state, &all);
+        return;
+    }
+
+    pool->state = state;
+    pthread_barrier_wait(&pool->start);
+    propose_stripe(state, &pool->stripes[0]);
+    pthread_barrier_wait(&pool->done);
+
+    for (int k = 0; k < pool->threads; ++k) apply_stripe(state, &pool->stripes[k]);
+}
+
+// ENGINE_ENTITIES
+// The same scan as update_all_elements(), but it walks a list of the objects
+// instead of the active cells. The list is kept in dense arrays, in the order
+// the scan meets the objects, so a pass reads it front to back. The board still
+// holds every tile and the rules still read it, the list only says where to look.
+//
+// An object can only move down or right, behind the scan, or left, where it
+// becomes a marker the scan turns back into a falling object right away. None
+// of the objects still ahead of the scan move, so the order of the list at the
+// start of a pass is the order the scan would meet them in.
+static inline int is_object(char c) {
+    switch (c) {
+        case 'O': case '$': case 'o': case 'S': case 'p': case 'i':
+            return 1;
+        default:
+            return 0;
+    }
+}
+
+static inline int64_t scan_key(const GameState* state, int x, int y) {
+    return (int64_t)y * state->width + x;
+}
+
+static inline void set_entity(EntityArrays* arrays, int k, int x, int y, char c) {
+    arrays->x[k] = x;
+    arrays->y[k] = y;
+    arrays->gem[k] = c == '$' || c == 'S' || c == 'p';
+    arrays->falling[k] = c == 'o' || c == 'S' || c == 'p' || c == 'i';
+}
+
+static inline void copy_entity(EntityArrays* to, int i, const EntityArrays* from, int k) {
+    to->x[i] = from->x[k];
+    to->y[i] = from->y[k];
+    to->gem[i] = from->gem[k];
+    to->falling[i] = from->falling[k];
+}
+
+void reserve_entities(EntityStore* entities, int count) {
+    if (count <= entities->capacity) return;
+    int capacity = entities->capacity ? entities->capacity : 1024;
+    while (capacity < count) capacity *= 2;
+    EntityArrays* arrays[2] = { &entities->live, &entities->moved };
+    for (int k = 0; k < 2; ++k) {
+        arrays[k]->x = reallocate(arrays[k]->x, sizeof(int) * capacity);
+        arrays[k]->y = reallocate(arrays[k]->y, sizeof(int) * capacity);
+        arrays[k]->gem = reallocate(arrays[k]->gem, capacity);
+        arrays[k]->falling = reallocate(arrays[k]->falling, capacity);
+    }
+    entities->has_moved = reallocate(entities->has_moved, capacity);
+    entities->capacity = capacity;
+}
+
+// Index of the first entry at or after (x, y) in scan order, searching from entry lo on.
+int entity_lower_bound(const GameState* state, int lo, int x, int y) {
+    const EntityArrays* live = &state->entities.live;
+    int64_t key = scan_key(state, x, y);
+    int hi = state->entities.count;
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        if (scan_key(state, live->x[mid], live->y[mid]) > key) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+void insert_entity(GameState* state, int k, int x, int y, char c) {
+    EntityStore* entities = &state->entities;
+    reserve_entities(entities, entities->count + 1);
+    EntityArrays* live = &entities->live;
+    size_t n = entities->count - k;
+    memmove(&live->x[k + 1], &live->x[k], sizeof(int) * n);
+    memmove(&live->y[k + 1], &live->y[k], sizeof(int) * n);
+    memmove(&live->gem[k + 1], &live->gem[k], n);
+    memmove(&live->falling[k + 1], &live->falling[k], n);
+    set_entity(live, k, x, y, c);
+    ++entities->count;
+}
+
+void remove_entity(GameState* state, int k) {
+    EntityStore* entities = &state->entities;
+    EntityArrays* live = &entities->live;
+    size_t n = entities->count - k - 1;
+    memmove(&live->x[k], &live->x[k + 1], sizeof(int) * n);
+    memmove(&live->y[k], &live->y[k + 1], sizeof(int) * n);
+    memmove(&live->gem[k], &live->gem[k + 1], n);
+    memmove(&live->falling[k], &live->falling[k + 1], n);
+    --entities->count;
+}
+
+void build_entities(GameState* state) {
+    EntityStore* entities = &state->entities;
+    entities->count = 0;
+    for (int y = state->height - 1; y >= 0; --y) {
+        for (int cx = state->chunks_x - 1; cx >= 0; --cx) {
+            const ChunkData* data = state->chunks[(size_t)(y >> CHUNK_SHIFT) * state->chunks_x + cx].data;
+            if (!data) continue; // uniform chunks hold no objects
+            const char* row = &data->tiles[state->front][chunk_cell(0, y)];
+            int n = state->width - cx * CHUNK_SIZE < CHUNK_SIZE ? state->width - cx * CHUNK_SIZE : CHUNK_SIZE;
+            for (int i = n - 1; i >= 0; --i) {
+                if (!is_object(row[i])) continue;
+                reserve_entities(entities, entities->count + 1);
+                set_entity(&entities->live, entities->count++, cx * CHUNK_SIZE + i, y, row[i]);
+            }
+        }
+    }
+}
+
+// Brings the list up to date with the cells written since damage entry first,
+// outside of the physics pass, e.g. a rock pushed or a gem collected by the player.
+// A cell that is already up to date is left as it is, so the list can be synced
+// with cells the pass wrote too.
+void sync_entities(GameState* state, int first) {
+    for (int k = first; k < state->damage_count; ++k) {
+        int x = state->damage[k] % state->width;
+        int y = state->damage[k] / state->width;
+        char c = get_cell(state, x, y);
+        int i = entity_lower_bound(state, 0, x, y);
+        const EntityArrays* live = &state->entities.live;
+        int found = i < state->entities.count && live->x[i] == x && live->y[i] == y;
+        if (found && !is_object(c)) {
+            remove_entity(state, i);
+        } else if (!found && is_object(c)) {
+            insert_entity(state, i, x, y, c);
+        } else if (found) {
+            set_entity(&state->entities.live, i, x, y, c);
+        }
+    }
+}
+
+// Counts from the list, without looking at the board.
+void count_entities(const EntityStore* entities, int* gems, int* falling) {
+    *gems = *falling = 0;
+    for (int k = 0; k < entities->count; ++k) {
+        *gems += entities->live.gem[k];
+        *falling += entities->live.falling[k];
+    }
+}
+
+// Takes (x, y) off the active cells, returns 0 if it was not one of them.
+static inline int take_active_cell(GameState* state, int x, int y) {
+    if (x < 1 || x > state->width - 2 || y < 1 || y > state->height - 1) return 0;
+    ChunkData* data = chunk_at(state, x, y)->data;
+    uint32_t bit = 1u << (x & CHUNK_MASK);
+    if (!data || !(data->active[y & CHUNK_MASK] & bit)) return 0;
+    data->active[y & CHUNK_MASK] &= ~bit;
+    if (--data->active_count == 0) sleep_chunk(state, x >> CHUNK_SHIFT, y >> CHUNK_SHIFT);
+    return 1;
+}
+
+// Moves n entries, the ranges may overlap.
+void move_entities(EntityArrays* to, int i, const EntityArrays* from, int k, int n) {
+    memmove(&to->x[i], &from->x[k], sizeof(int) * n);
+    memmove(&to->y[i], &from->y[k], sizeof(int) * n);
+    memmove(&to->gem[i], &from->gem[k], n);
+    memmove(&to->falling[i], &from->falling[k], n);
+}
+
+// The entries that moved are taken out, sorted and merged back in with the
+// others, which are still in order. An object moves by one cell at most, so the
+// moved entries are nearly in order already and the insertion sort is short.
+// The entries in between are moved as whole runs.
+void sort_moved_entities(GameState* state) {
+    EntityStore* entities = &state->entities;
+    EntityArrays* live = &entities->live;
+    EntityArrays* moved = &entities->moved;
+    int k = 0;
+    while (!entities->has_moved[k]) ++k;
+    int kept = k, moved_count = 0;
+    while (k < entities->count) {
+        if (entities->has_moved[k]) {
+            copy_entity(moved, moved_count++, live, k++);
+            continue;
+        }
+        int run = k;
+        while (k < entities->count && !entities->has_moved[k]) ++k;
+        move_entities(live, kept, live, run, k - run);
+        kept += k - run;
+    }
+    for (int k = 1; k < moved_count; ++k) {
+        int x = moved->x[k], y = moved->y[k];
+        uint8_t gem = moved->gem[k], falling = moved->falling[k];
+        int i = k;
+        for (; i > 0 && scan_key(state, moved->x[i - 1], moved->y[i - 1]) < scan_key(state, x, y); --i) {
+            copy_entity(moved, i, moved, i - 1);
+        }
+        moved->x[i] = x;
+        moved->y[i] = y;
+        moved->gem[i] = gem;
+        moved->falling[i] = falling;
+    }
+    // merge from the back, where the kept entries are out of the way
+    int out = entities->count;
+    for (int b = moved_count - 1; b >= 0; --b) {
+        int64_t key = scan_key(state, moved->x[b], moved->y[b]);
+        int lo = 0, hi = kept; // first kept entry that comes after moved entry b
+        while (lo < hi) {
+            int mid = lo + (hi - lo) / 2;
+            if (scan_key(state, live->x[mid], live->y[mid]) > key) {
+                lo = mid + 1;
+            } else {
+                hi = mid;
+            }
+        }
+        if (lo < kept) {
+            out -= kept - lo;
+            move_entities(live, out, live, lo, kept - lo);
+            kept = lo;
+        }
+        copy_entity(live, --out, moved, b);
+    }
+}
+
+void update_all_elements_entities(GameState* state) {
+    EntityStore* entities = &state->entities;
+    EntityArrays* live = &entities->live;
+    int moves = 0;
+    memset(entities->has_moved, 0, entities->count);
+    for (int k = 0; k < entities->count; ++k) {
+        int x = live->x[k], y = live->y[k];
+        int cy = y >> CHUNK_SHIFT;
+        if (!(state->awake_bands[cy >> 6] & (1ULL << (cy & 63)))) {
+            // a row of sleeping chunks, on to the first object above it
+            k = entity_lower_bound(state, k + 1, state->width - 1, (cy << CHUNK_SHIFT) - 1) - 1;
+            continue;
+        }
+        if (!take_active_cell(state, x, y)) continue; // resting, the scan would skip it too
+        char left = get_cell(state, x - 1, y), right = get_cell(state, x + 1, y), below = get_cell(state, x, y + 1);
+        update_cell(state, x, y);
+        char c = get_cell(state, x, y);
+        if (!is_object(c)) {
+            if (left == ' ' && (get_cell(state, x - 1, y) == 'p' || get_cell(state, x - 1, y) == 'i')) {
+                --x; // the marker is the next cell the scan handles
+                take_active_cell(state, x, y);
+                update_cell(state, x, y);
+            } else if (below == ' ' && is_object(get_cell(state, x, y + 1))) {
+                ++y;
+            } else if (right == ' ' && is_object(get_cell(state, x + 1, y))) {
+                ++x;
+            }
+            c = get_cell(state, x, y);
+            entities->has_moved[k] = 1;
+            ++moves;
+        }
+        set_entity(live, k, x, y, c);
+    }
+    if (moves) sort_moved_entities(state);
+}
+
+// Pages in the chunks around the player, or around the view when there is one, and
+// evicts sleeping chunks elsewhere when more than max_resident chunks are resident.
+// The sweep goes round the chunks like a clock hand and stops at 7/8 of the cap, so
+// it does not run on every tick. Chunks that are awake are never evicted, the cap is
+// only kept as long as enough of the level sleeps.
+// It runs between ticks, where both boards are the same and nothing is damaged.
+void stream_chunks(GameState* state) {
+    Stream* stream = state->stream;
+    int x0 = state->pos_x, y0 = state->pos_y, x1 = state->pos_x, y1 = state->pos_y, margin = 2;
+    if (state->view_width) {
+        x0 = state->view_x;
+        y0 = state->view_y;
+        x1 = state->view_x + state->view_width - 1;
+        y1 = state->view_y + state->view_height - 1;
+        margin = 1;
+    }
+    int cx0 = (x0 >> CHUNK_SHIFT) - margin > 0 ? (x0 >> CHUNK_SHIFT) - margin : 0;
+    int cy0 = (y0 >> CHUNK_SHIFT) - margin > 0 ? (y0 >> CHUNK_SHIFT) - margin : 0;
+    int cx1 = (x1 >> CHUNK_SHIFT) + margin < state->chunks_x ? (x1 >> CHUNK_SHIFT) + margin : state->chunks_x - 1;
+    int cy1 = (y1 >> CHUNK_SHIFT) + margin < state->chunks_y ? (y1 >> CHUNK_SHIFT) + margin : state->chunks_y - 1;
+    for (int cy = cy0; cy <= cy1; ++cy) {
+        for (int cx = cx0; cx <= cx1; ++cx) {
+            if (state->chunks[cy * state->chunks_x + cx].cells) page_in_chunk(state, cx, cy);
+        }
+    }
+    if (state->resident_chunks <= stream->max_resident) return;
+
+    long target = stream->max_resident - stream->max_resident / 8;
+    size_t chunks = (size_t)state->chunks_x * state->chunks_y;
+    for (size_t n = 0; n < chunks && state->resident_chunks > target; ++n) {
+        size_t k = stream->hand;
+        stream->hand = k + 1 < chunks ? k + 1 : 0;
+        Chunk* chunk = &state->chunks[k];
+        int cx = k % state->chunks_x, cy = k / state->chunks_x;
+        if (!chunk->data || chunk->data->active_count) continue;
+        if (cx >= cx0 && cx <= cx1 && cy >= cy0 && cy <= cy1) continue;
+        uint8_t* packed = &stream->spill[k * PACKED_CHUNK_SIZE];
+        pack_chunk(chunk->data->tiles[state->front], packed);
+        free(chunk->data);
+        chunk->data = NULL;
+        chunk->cells = packed;
+        --state->resident_chunks;
+        ++stream->evicted;
+    }
+}
+
+// Rebuilds what is derived from the board, on the first tick after loading.
+void prepare_board(GameState* state) {
+    for (size_t k = 0; k < (size_t)state->chunks_x * state->chunks_y; ++k) {
+        ChunkData* data = state->chunks[k].data;
+        if (data) memcpy(data->tiles[state->front], data->tiles[state->front ^ 1], sizeof(data->tiles[0]));
+    }
+    seed_active_cells(state);
+    if (state->engine == ENGINE_BITBOARD) build_bitboard(state);
+    if (state->engine == ENGINE_ENTITIES) build_entities(state);
+    state->prepared = 1;
+}
+
+// One frame of the game. A tick starts with the player's move and ends when its
+// physics pass is done. With a budget of max_cells cells or max_ns nanoseconds
+// (0 for no limit), a pass that does not fit goes on in the next call, so a frame
+// stays short even when a cave-in wakes up half the board. Only the scan engines
+// can stop in the middle of a pass, the others always finish it.
+// Returns 1 when the tick is done.
+int update_slice(GameState* state, long max_cells, long max_ns) {
+    if (!state->prepared) {
+        prepare_board(state);
+    } else {
+        sync_screens(state);
+    }
+    if (!state->mid_pass) {
+        if (state->stream) stream_chunks(state);
+        int first_damage = state->damage_count;
+        handle_player(state);
+        if (state->engine == ENGINE_BITBOARD) {
+            update_all_elements_bitboard(state);
+        } else if (state->engine == ENGINE_TWO_BUFFER) {
+            update_all_elements_two_buffer(state);
+        } else if (state->engine == ENGINE_ENTITIES) {
+            sync_entities(state, first_damage);
+            update_all_elements_entities(state);
+        } else {
+            start_scan(state);
+            state->mid_pass = 1;
+        }
+    }
+    if (state->mid_pass) {
+        if (!update_all_elements_until(state, max_cells, max_ns)) return 0;
+        state->mid_pass = 0;
+    }
+    ++state->count;
+    state->settled = 0; // the player may have moved something
+    return 1;
+}
+
+void update(GameState* state) {
+    update_slice(state, 0, 0);
+}
+
+// Start of a view of size cells along one axis of a board of total cells,
+// moved as little as possible to keep pos a quarter of the view away from its edges.
+int follow(int start, int pos, int size, int total) {
+    int margin = size / 4;
+    if (pos < start + margin) start = pos - margin;
+    if (pos > start + size - 1 - margin) start = pos - size + 1 + margin;
+    if (start > total - size) start = total - size;
+    if (start < 0) start = 0;
+    return start;
+}
+
+// The whole board, or as much of it as fits on the terminal.
+void init_view(GameState* state) {
+    state->view_width = state->width - 1; // without the '\n' column
+    state->view_height = state->height;
+    struct winsize ws;
+    if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == 0 && ws.ws_col > 0 && ws.ws_row > 2) {
+        if (state->view_width > ws.ws_col) state->view_width = ws.ws_col;
+        if (state->view_height > ws.ws_row - 2) state->view_height = ws.ws_row - 2; // room for the end message
+    }
+    state->view_x = follow(0, state->pos_x, state->view_width, state->width - 1);
+    state->view_y = follow(0, state->pos_y, state->view_height, state->height);
+    view_rows = state->view_height;
+    state->redraw = 1;
+    free(state->skipped);
+    state->skipped = allocate(((size_t)state->view_width * state->view_height + 63) / 64, sizeof(uint64_t));
+}
+
+void draw_gem(GameState* state, int x, int y) {
+    int l = ((state->count + 5 * y + 7 * x) % 16) / 8;
+    printf("\e[%d;%dH", y - state->view_y + 1, x - state->view_x + 1); // move cursor
+    if (l == 0) {
+        printf("\e[48;2;10;10;40m\e[38;2;153;51;255m$");
+    } else {
+        printf("\e[48;2;10;10;40m\e[38;12;33;61;255m$");
+    }
+}
+
+void draw_tile(GameState* state, int x, int y, char c) {
+    printf("\e[%d;%dH", y - state->view_y + 1, x - state->view_x + 1); // move cursor
+    switch (c) {
+    case 'X':
+        printf("\e[48;2;51;51;81m\e[38;2;91;91;91mX");
+        break;
+    case '.':
+        printf("\e[48;2;80;76;60m\e[38;2;51;0;25m ");
+        break;
+    case ' ':
+        printf("\e[48;2;10;10;40m ");
+        break;
+    case 'O':
+        printf("\e[48;2;10;10;40m\e[38;2;202;198;194mO");
+        break;
+    case 'o':
+        printf("\e[48;2;10;10;40m\e[38;2;202;198;194mo");
+        break;
+    case '@':
+        printf("\e[48;2;10;10;40m\e[38;2;235;51;51m@");
+        break;
+    case 'E':
+        printf("\e[48;2;10;10;40m\e[38;2;251;251;15mE");
+    default:
+        break;
+    }
+}
+
+static inline int in_view(const GameState* state, int x, int y) {
+    return x >= state->view_x && x < state->view_x + state->view_width
+        && y >= state->view_y && y < state->view_y + state->view_height;
+}
+
+// Leaves the cells written during this tick to the next render(), for ticks that
+// come faster than the terminal is drawn. A cell of the view is drawn once however
+// many of the ticks in between wrote it, so a frame is never more than the view.
+// The view only moves in render(), so it is the one the bits are relative to.
+void skip_render(GameState* state) {
+    for (int k = 0; k < state->damage_count; ++k) {
+        int x = state->damage[k] % state->width;
+        int y = state->damage[k] / state->width;
+        if (!in_view(state, x, y)) continue;
+        size_t i = (size_t)(y - state->view_y) * state->view_width + (x - state->view_x);
+        state->skipped[i >> 6] |= 1ull << (i & 63);
+    }
+}
+
+// Draws the cells written during this tick, and those of skipped ticks, and animates
+// the gems. Only chunks that have gems are looked at for the animation, the rest of
+// the view stays as is.
+void render(GameState* state) {
+    // when the view scrolls every cell on the terminal shows something else
+    int view_x = follow(state->view_x, state->pos_x, state->view_width, state->width - 1);
+    int view_y = follow(state->view_y, state->pos_y, state->view_height, state->height);
+    if (view_x != state->view_x || view_y != state->view_y) state->redraw = 1;
+    state->view_x = view_x;
+    state->view_y = view_y;
+
+    size_t skipped_words = ((size_t)state->view_width * state->view_height + 63) / 64;
+    if (state->redraw) {
+        memset(state->skipped, 0, skipped_words * sizeof(uint64_t));
+        for (int j = view_y; j < view_y + state->view_height; ++j) {
+            for (int i = view_x; i < view_x + state->view_width; ++i) {
+                char c = get_cell(state, i, j);
+                if (is_gem(c)) {
+                    draw_gem(state, i, j);
+                } else {
+                    draw_tile(state, i, j, c);
+                }
+            }
+        }
+        state->redraw = 0;
+        fflush(stdout);
+        return;
+    }
+
+    for (int k = 0; k < state->damage_count; ++k) {
+        int x = state->damage[k] % state->width;
+        int y = state->damage[k] / state->width;
+        char c = get_cell(state, x, y);
+        if (in_view(state, x, y) && !is_gem(c) && c != get_old_cell(state, x, y)) draw_tile(state, x, y, c);
+    }
+    for (size_t w = 0; w < skipped_words; ++w) {
+        for (uint64_t bits = state->skipped[w]; bits; bits &= bits - 1) {
+            size_t i = w * 64 + __builtin_ctzll(bits);
+            int x = view_x + i % state->view_width, y = view_y + i / state->view_width;
+            char c = get_cell(state, x, y);
+            if (!is_gem(c)) draw_tile(state, x, y, c);
+        }
+        state->skipped[w] = 0;
+    }
+
+    int last_x = view_x + state->view_width - 1;
+    int last_y = view_y + state->view_height - 1;
+    for (int cy = view_y >> CHUNK_SHIFT; cy <= last_y >> CHUNK_SHIFT; ++cy) {
+        for (int cx = view_x >> CHUNK_SHIFT; cx <= last_x >> CHUNK_SHIFT; ++cx) {
+            if (state->chunks[cy * state->chunks_x + cx].gems == 0) continue;
+            for (int j = cy * CHUNK_SIZE; j < (cy + 1) * CHUNK_SIZE; ++j) {
+                for (int i = cx * CHUNK_SIZE; i < (cx + 1) * CHUNK_SIZE; ++i) {
+                    if (in_view(state, i, j) && is_gem(get_cell(state, i, j))) draw_gem(state, i, j);
+                }
+            }
+        }
+    }
+    fflush(stdout);
+}
+
+// Runs ticks without a key until one of them changes nothing, at most max_ticks,
+// and makes the board it ends on the loaded one. Only the parts that move cost
+// anything, so a level that settles in a few hundred ticks does so in a blink.
+// Returns the number of ticks that changed the board, or -1 if a rock or gem
+// would land on the player, in which case the board stays as it was loaded.
+long settle_level(GameState* state, long max_ticks) {
+    char* loaded = allocate(board_size(state), 1);
+    copy_board(state, state->front, loaded);
+    int key = state->key;
+    state->key = 0;
+    long ticks = 0;
+    while (ticks < max_ticks) {
+        update(state);
+        int changed = state->damage_count != 0;
+        swap_screens(state);
+        if (state->dead || !changed) break;
+        ++ticks;
+    }
+    if (state->dead) {
+        ticks = -1;
+    } else {
+        copy_board(state, state->front ^ 1, loaded);
+    }
+    load_board(state, loaded);
+    free(loaded);
+    state->key = key;
+    state->count = 0;
+    state->dead = 0;
+    state->settled = ticks >= 0 && ticks < max_ticks;
+    return ticks;
+}
+
+// What parse_level() found in a level file.
+typedef struct {
+    int width; // length of the first row including its '\n'
+    int height;
+    int pos_x;
+    int pos_y;
+    int gems;
+    // Why the level can't be played, and where: line and column count from 1,
+    // line is 0 when it is not about one place.
+    char error[64];
+    long line;
+    long column;
+} LevelInfo;
+
+static int level_error(LevelInfo* info, long y, long x, const char* message, char c) {
+    info->line = y + 1;
+    info->column = x + 1;
+    if (c >= ' ' && c <= '~') {
+        snprintf(info->error, sizeof(info->error), "%s '%c'", message, c);
+    } else if (c) {
+        snprintf(info->error, sizeof(info->error), "%s 0x%02x", message, (uint8_t)c);
+    } else {
+        snprintf(info->error, sizeof(info->error), "%s", message);
+    }
+    return -1;
+}
+
+// What each character counts as for parse_level(), in 16 bit lanes, so a
+// run of up to 0xffff tiles is checked by adding up one table entry per tile.
+#define LEVEL_TILE 1ULL // anything from packed_tiles but '\n'
+#define LEVEL_GAP (1ULL << 16) // anything but a wall
+#define LEVEL_PLAYER (1ULL << 32)
+#define LEVEL_GEM (1ULL << 48)
+
+static const uint64_t level_tiles[256] = {
+    [' '] = LEVEL_TILE | LEVEL_GAP, ['X'] = LEVEL_TILE, ['.'] = LEVEL_TILE | LEVEL_GAP,
+    ['O'] = LEVEL_TILE | LEVEL_GAP, ['o'] = LEVEL_TILE | LEVEL_GAP, ['S'] = LEVEL_TILE | LEVEL_GAP | LEVEL_GEM,
+    ['$'] = LEVEL_TILE | LEVEL_GAP | LEVEL_GEM, ['@'] = LEVEL_TILE | LEVEL_GAP | LEVEL_PLAYER,
+    ['E'] = LEVEL_TILE | LEVEL_GAP, ['p'] = LEVEL_TILE | LEVEL_GAP, ['i'] = LEVEL_TILE | LEVEL_GAP,
+};
+
+// Checks a level in a single pass over it, and finds the player and counts the
+// gems on the way. The size of the board comes from the file: width is the length
+// of the first row including its '\n', and every other row has to be just as long.
+// Only tiles from packed_tiles, walls all around and exactly one player.
+// A row is looked at tile by tile only when it holds the player or something is wrong.
+int parse_level(const char* data, size_t size, LevelInfo* info) {
+    *info = (LevelInfo){};
+    long y = 0, width = 0;
+    long gap = -1; // first column of the last row that is not a wall
+    int players = 0;
+    for (const char* row = data, *end = data + size; row < end; ++y) {
+        const char* newline = memchr(row, '\n', end - row);
+        long n = (newline ? newline : end) - row; // tiles in the row
+        if (y == 0) width = n + 1;
+        if (!newline) return level_error(info, y, n, "last row does not end in a newline", 0);
+        if (n + 1 < width) return level_error(info, y, n, "row is shorter than the first one", 0);
+        if (n + 1 > width) return level_error(info, y, width - 1, "row is longer than the first one", 0);
+        if (width < 3) return level_error(info, y, n, "row is narrower than 2 tiles", 0);
+        if (width > 0x7fffffff) return level_error(info, y, 0x7ffffffe, "row is too long", 0);
+        if (y == 0x7fffffff) return level_error(info, y, 0, "too many rows", 0);
+
+        long tiles = 0, gaps = 0, row_players = 0;
+        for (long x0 = 0; x0 < n; x0 += 0xffff) {
+            long x1 = x0 + 0xffff < n ? x0 + 0xffff : n;
+            uint64_t sum = 0;
+            for (long x = x0; x < x1; ++x) sum += level_tiles[(uint8_t)row[x]];
+            tiles += sum & 0xffff;
+            gaps += sum >> 16 & 0xffff;
+            row_players += sum >> 32 & 0xffff;
+            info->gems += sum >> 48;
+        }
+        for (long x = 0; x < n && (tiles < n || row_players); ++x) {
+            if (!level_tiles[(uint8_t)row[x]]) return level_error(info, y, x, "unknown tile", row[x]);
+            if (row[x] != '@') continue;
+            if (players++) return level_error(info, y, x, "second player", 0);
+            info->pos_x = x;
+            info->pos_y = y;
+        }
+        if (row[0] != 'X') return level_error(info, y, 0, "border is not a wall", 0);
+        if (row[n - 1] != 'X') return level_error(info, y, n - 1, "border is not a wall", 0);
+        for (gap = gaps ? 0 : -1; gap >= 0 && row[gap] == 'X'; ++gap) {}
+        if (y == 0 && gap >= 0) return level_error(info, y, gap, "border is not a wall", 0);
+        row = newline + 1;
+    }
+    if (y < 3) return level_error(info, -1, 0, "level has fewer than 3 rows", 0);
+    if (gap >= 0) return level_error(info, y - 1, gap, "border is not a wall", 0);
+    if (!players) return level_error(info, -1, 0, "no player", 0);
+    info->width = width;
+    info->height = y;
+    return 0;
+}
+
+int load_text_level(GameState* state, const char* data, size_t size, LevelInfo* info) {
+    if (parse_level(data, size, info) != 0) return -1;
+    init_game_state(state, info->width, info->height);
+    load_board(state, data);
+    state->pos_x = info->pos_x;
+    state->pos_y = info->pos_y;
+    state->level_gems = info->gems;
+    return 0;
+}
+
+// Binary levels: a header of little endian fields, a map of the chunks of the board
+// in the order of GameState.chunks, and a block for every chunk that is not uniform.
+// A run of uniform chunks is the tile code of their fill, see packed_tiles, and the
+// length of the run in 7 bit groups, lowest first, all but the last with the top bit
+// set. Any other chunk is LEVEL_CHUNK_CELLS in the map and its cells, packed like
+// pack_chunk() does, are the next block. The map is small, a few bytes for a run and
+// one for every other chunk, and every block has its own checksum, so a streamed level
+// only reads the map up front and a block when its chunk is needed.
+// Chunks are uniform exactly where load_board() makes them uniform, and the header
+// has the hash of the board, so a binary level loads into the same game as its text
+// file, without looking at the cells of the uniform chunks at all.
+// Only a settled level is streamed, the chunks that are not unpacked don't move, so
+// one that still has something falling would play differently from the whole level.
+#define LEVEL_MAGIC "LTGL"
+#define LEVEL_VERSION 2
+#define LEVEL_HEADER_SIZE 64
+#define LEVEL_CHUNK_CELLS 0x10
+#define LEVEL_SETTLED 1 // flags: GameState.settled
+
+typedef struct {
+    uint32_t version;
+    uint32_t width; // like GameState.width, with the '\n' column
+    uint32_t height;
+    uint32_t pos_x;
+    uint32_t pos_y;
+    uint32_t gems;
+    uint16_t chunk_size; // CHUNK_SIZE of the game that wrote it
+    uint16_t flags;
+    uint64_t board_hash;
+    uint64_t map_size;
+    uint64_t blocks;
+    uint64_t checksum; // level_checksum() of the header before it and the map
+} LevelHeader;
+
+int is_binary_level(const char* data, size_t size) {
+    return size >= 4 && memcmp(data, LEVEL_MAGIC, 4) == 0;
+}
+
+// One of the boards, state->front for a freshly loaded level, see load_binary_level().
+// Chunks of a streamed level that were never paged in are copied as they are.
+// Returns the size of the allocated *out.
+size_t write_binary_level(const GameState* state, int board, uint8_t** out) {
+    size_t chunks = (size_t)state->chunks_x * state->chunks_y, blocks = 0;
+    for (size_t k = 0; k < chunks; ++k) blocks += state->chunks[k].data || state->chunks[k].cells;
+    size_t map_size = 0, capacity = 4096;
+    uint8_t* map = allocate(capacity, 1);
+    uint8_t* block = allocate(blocks ? blocks : 1, PACKED_CHUNK_SIZE);
+    uint8_t* next_block = block;
+    for (size_t k = 0; k < chunks;) {
+        if (capacity - map_size < 16) {
+            capacity *= 2;
+            map = reallocate(map, capacity);
+        }
+        const Chunk* chunk = &state->chunks[k];
+        if (chunk->data || chunk->cells) {
+            if (chunk->data) {
+                pack_chunk(chunk->data->tiles[board], next_block);
+            } else {
+                memcpy(next_block, chunk->cells, PACKED_CHUNK_SIZE);
+            }
+            next_block += PACKED_CHUNK_SIZE;
+            map[map_size++] = LEVEL_CHUNK_CELLS;
+            ++k;
+            continue;
+        }
+        size_t run = 1;
+        while (k + run < chunks && !state->chunks[k + run].data && !state->chunks[k + run].cells
+            && state->chunks[k + run].fill == chunk->fill) ++run;
+        k += run;
+        map[map_size++] = tile_codes[(uint8_t)chunk->fill] - 1;
+        for (; run >= 0x80; run >>= 7) map[map_size++] = (uint8_t)(run | 0x80);
+        map[map_size++] = (uint8_t)run;
+    }
+    size_t size = LEVEL_HEADER_SIZE + map_size + blocks * PACKED_CHUNK_SIZE;
+    uint8_t* level = allocate(size, 1);
+    memcpy(level, LEVEL_MAGIC, 4);
+    put_le(&level[4], LEVEL_VERSION, 4);
+    put_le(&level[8], state->width, 4);
+    put_le(&level[12], state->height, 4);
+    put_le(&level[16], state->pos_x, 4);
+    put_le(&level[20], state->pos_y, 4);
+    put_le(&level[24], state->level_gems, 4);
+    put_le(&level[28], CHUNK_SIZE, 2);
+    put_le(&level[30], state->settled ? LEVEL_SETTLED : 0, 2);
+    put_le(&level[32], state->board_hash, 8);
+    put_le(&level[40], map_size, 8);
+    put_le(&level[48], blocks, 8);
+    memcpy(&level[LEVEL_HEADER_SIZE], map, map_size);
+    memcpy(&level[LEVEL_HEADER_SIZE + map_size], block, blocks * PACKED_CHUNK_SIZE);
+    uint64_t checksum = level_checksum(CHECKSUM_SEED, level, LEVEL_HEADER_SIZE - 8);
+    put_le(&level[56], level_checksum(checksum, &level[LEVEL_HEADER_SIZE], map_size), 8);
+    free(map);
+    free(block);
+    *out = level;
+    return size;
+}
+
+// With stream set, the chunks that are not uniform keep pointing at their blocks
+// in data, which has to stay mapped, and are only unpacked when they are paged in,
+// see stream_chunks(). Otherwise every block is checked and unpacked here.
+int load_binary_level(GameState* state, const uint8_t* data, size_t size, int stream, LevelInfo* info) {
+    *info = (LevelInfo){};
+    if (!is_binary_level((const char*)data, size) || size < LEVEL_HEADER_SIZE) return level_error(info, -1, 0, "not a binary level", 0);
+    LevelHeader h = {
+        .version = get_le(&data[4], 4), .width = get_le(&data[8], 4), .height = get_le(&data[12], 4),
+        .pos_x = get_le(&data[16], 4), .pos_y = get_le(&data[20], 4), .gems = get_le(&data[24], 4),
+        .chunk_size = get_le(&data[28], 2), .flags = get_le(&data[30], 2), .board_hash = get_le(&data[32], 8),
+        .map_size = get_le(&data[40], 8), .blocks = get_le(&data[48], 8), .checksum = get_le(&data[56], 8),
+    };
+    if (h.version != LEVEL_VERSION) return level_error(info, -1, 0, "unknown version of binary level", 0);
+    if (h.chunk_size != CHUNK_SIZE) return level_error(info, -1, 0, "binary level made for another chunk size", 0);
+    if (stream && !(h.flags & LEVEL_SETTLED)) {
+        return level_error(info, -1, 0, "binary level was not converted with --settle", 0);
+    }
+    if (h.map_size > size - LEVEL_HEADER_SIZE || h.blocks != (size - LEVEL_HEADER_SIZE - h.map_size) / PACKED_CHUNK_SIZE
+            || (size - LEVEL_HEADER_SIZE - h.map_size) % PACKED_CHUNK_SIZE != 0) {
+        return level_error(info, -1, 0, "binary level is cut off", 0);
+    }
+    uint64_t checksum = level_checksum(CHECKSUM_SEED, data, LEVEL_HEADER_SIZE - 8);
+    if (level_checksum(checksum, &data[LEVEL_HEADER_SIZE], h.map_size) != h.checksum) {
+        return level_error(info, -1, 0, "binary level is damaged, checksum mismatch", 0);
+    }
+    if (h.width < 3 || h.width > 0x7fffffff || h.height < 3 || h.height > 0x7fffffff
+            || h.pos_x >= h.width - 1 || h.pos_y >= h.height) {
+        return level_error(info, -1, 0, "binary level has a broken header", 0);
+    }
+
+    init_game_state(state, h.width, h.height);
+    const uint8_t* p = &data[LEVEL_HEADER_SIZE];
+    const uint8_t* end = p + h.map_size;
+    const uint8_t* block = end;
+    size_t chunks = (size_t)state->chunks_x * state->chunks_y;
+    for (size_t k = 0; k < chunks;) {
+        if (p == end) return level_error(info, -1, 0, "binary level has too few chunks", 0);
+        Chunk* chunk = &state->chunks[k];
+        uint8_t tag = *p++;
+        if (tag == LEVEL_CHUNK_CELLS) {
+            if (block == data + size) return level_error(info, -1, 0, "binary level has too few chunks", 0);
+            chunk->cells = block;
+            chunk->fill = packed_tiles[*block & 15];
+            block += PACKED_CHUNK_SIZE;
+            if (!stream && unpack_chunk_data(state, chunk) != 0) {
+                return level_error(info, -1, 0, "binary level is damaged, a chunk does not match its checksum", 0);
+            }
+            ++k;
+            continue;
+        }
+        size_t run = 0;
+        for (int shift = 0; p < end && shift < 63; shift += 7) {
+            run |= (size_t)(*p & 0x7f) << shift;
+            if (!(*p++ & 0x80)) break;
+        }
+        if (tag > 11 || run == 0 || run > chunks - k) return level_error(info, -1, 0, "binary level has a broken run of chunks", 0);
+        char fill = packed_tiles[tag];
+        for (size_t end_run = k + run; k < end_run; ++k) {
+            int x0 = (k % state->chunks_x) * CHUNK_SIZE, y0 = (k / state->chunks_x) * CHUNK_SIZE;
+            if (strchr("O$oSpi@\n", fill) || x0 + CHUNK_SIZE > state->width || y0 + CHUNK_SIZE > state->height) {
+                return level_error(info, -1, 0, "binary level has a uniform chunk that can't be", 0);
+            }
+            state->chunks[k].fill = fill;
+        }
+    }
+    if (p != end || block != data + size) return level_error(info, -1, 0, "binary level has too many chunks", 0);
+    if (get_cell(state, h.pos_x, h.pos_y) != '@') return level_error(info, -1, 0, "binary level has no player at the start", 0);
+    state->board_hash = h.board_hash;
+    state->pos_x = h.pos_x;
+    state->pos_y = h.pos_y;
+    state->level_gems = h.gems;
+    state->settled = h.flags & LEVEL_SETTLED;
+    clear_awake_chunks(state);
+    state->damage_count = 0;
+    state->prepared = 0;
+    return 0;
+}
+
+// Mapped instead of read, so a big level is parsed and copied into the chunks
+// straight from the page cache, without a copy of the whole file.
+// Returns NULL with info set if there is nothing to map.
+char* map_level(const char* path, size_t* size, LevelInfo* info) {
+    *info = (LevelInfo){};
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        if (fd >= 0) close(fd);
+        level_error(info, -1, 0, "can't be opened", 0);
+        return NULL;
+    }
+    if (st.st_size == 0) {
+        close(fd);
+        level_error(info, -1, 0, "is empty", 0);
+        return NULL;
+    }
+    char* data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        level_error(info, -1, 0, "can't be read", 0);
+        return NULL;
+    }
+    *size = st.st_size;
+    return data;
+}
+
+void exit_level_error(const char* path, const LevelInfo* info) {
+    if (info->line) {
+        fprintf(stderr, "%s:%ld:%ld: %s\n", path, info->line, info->column, info->error);
+    } else {
+        fprintf(stderr, "%s: %s\n", path, info->error);
+    }
+    exit(EXIT_FAILURE);
+}
+
+// Text and binary levels are told apart by the first bytes.
+int try_load_level(GameState* state, const char* path, LevelInfo* info) {
+    size_t size;
+    char* data = map_level(path, &size, info);
+    if (!data) return -1;
+    madvise(data, size, MADV_SEQUENTIAL);
+    int ret = is_binary_level(data, size)
+        ? load_binary_level(state, (const uint8_t*)data, size, 0, info)
+        : load_text_level(state, data, size, info);
+    munmap(data, size);
+    return ret;
+}
+
+void load_level(GameState* state, const char* path) {
+    LevelInfo info;
+    if (try_load_level(state, path, &info) != 0) exit_level_error(path, &info);
+}
+
+// For a level that load_binary_level() streams from level, which the stream takes over.
+// Evicted chunks go to an unlinked file in $TMPDIR or /var/tmp, which unlike /tmp is
+// rarely kept in memory. It is as large as all the chunks packed, but sparse, only
+// the chunks that were evicted take up space.
+void start_stream(GameState* state, const uint8_t* level, size_t size, int mapped, long max_resident) {
+    Stream* stream = allocate(1, sizeof(Stream));
+    *stream = (Stream){ .level = level, .level_size = size, .mapped = mapped, .max_resident = max_resident };
+    stream->spill_size = (size_t)state->chunks_x * state->chunks_y * PACKED_CHUNK_SIZE;
+    const char* dir = getenv("TMPDIR") && *getenv("TMPDIR") ? getenv("TMPDIR") : "/var/tmp";
+    char spill_path[4096];
+    snprintf(spill_path, sizeof(spill_path), "%s/game-spill-XXXXXX", dir);
+    int fd = mkstemp(spill_path);
+    if (fd >= 0) unlink(spill_path);
+    stream->spill = fd >= 0 && ftruncate(fd, stream->spill_size) == 0
+        ? mmap(NULL, stream->spill_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0) : MAP_FAILED;
+    if (fd >= 0) close(fd);
+    if (stream->spill == MAP_FAILED) {
+        fprintf(stderr, "Failed to make a spill file in %s\n", dir);
+        exit(EXIT_FAILURE);
+    }
+    state->stream = stream;
+}
+
+// --memory-cap: a binary level, played without unpacking more than max_resident of its chunks.
+void stream_level(GameState* state, const char* path, long max_resident) {
+    size_t size;
+    LevelInfo info;
+    char* data = map_level(path, &size, &info);
+    if (!data) exit_level_error(path, &info);
+    if (!is_binary_level(data, size)) {
+        fprintf(stderr, "%s: only binary levels can be streamed, see --convert\n", path);
+        exit(EXIT_FAILURE);
+    }
+    madvise(data, size, MADV_RANDOM);
+    if (load_binary_level(state, (const uint8_t*)data, size, 1, &info) != 0) exit_level_error(path, &info);
+    start_stream(state, (const uint8_t*)data, size, 1, max_resident);
+}
+
+// Makes the board of a game that is being played the board of level, a freshly loaded
+// level of the same size, by writing only the cells that differ through set_cell().
+// So render() only draws those, sleeping chunks that did not change stay asleep, and
+// pairs of uniform chunks with the same fill are not even looked at. It is written
+// like a write of the player's, after the physics pass of a tick and before render().
+// The player starts over where the level has it. Returns the number of cells written.
+long reload_board(GameState* state, const GameState* level) {
+    long written = 0;
+    for (int cy = 0; cy < state->chunks_y; ++cy) {
+        for (int cx = 0; cx < state->chunks_x; ++cx) {
+            const Chunk* a = &state->chunks[cy * state->chunks_x + cx];
+            const Chunk* b = &level->chunks[cy * state->chunks_x + cx];
+            if (!a->data && !a->cells && !b->data && !b->cells && a->fill == b->fill) continue;
+            int y1 = (cy + 1) * CHUNK_SIZE < state->height ? (cy + 1) * CHUNK_SIZE : state->height;
+            int x1 = (cx + 1) * CHUNK_SIZE < state->width ? (cx + 1) * CHUNK_SIZE : state->width;
+            for (int y = cy * CHUNK_SIZE; y < y1; ++y) {
+                for (int x = cx * CHUNK_SIZE; x < x1; ++x) {
+                    char c = get_cell(level, x, y);
+                    if (get_cell(state, x, y) == c) continue;
+                    set_cell(state, x, y, c);
+                    ++written;
+                }
+            }
+        }
+    }
+    // a cell the physics pass wrote too is not in the damage list twice, so all of it,
+    // unless so much changed that inserting the entries one by one costs more than the board
+    if (state->engine == ENGINE_ENTITIES && state->prepared) {
+        if (written > state->entities.count / 8 + 1024) {
+            build_entities(state);
+        } else {
+            sync_entities(state, 0);
+        }
+    }
+    state->pos_x = level->pos_x;
+    state->pos_y = level->pos_y;
+    state->level_gems = level->level_gems;
+    state->gems_collected = 0;
+    state->dead = 0;
+    state->won = 0;
+    return written;
+}
+
+// Loads the level file being played again, after it was edited. A level of the same
+// size goes through reload_board(), any other replaces the game, which then has to be
+// drawn from scratch. Returns 1 in that case, 0 after reload_board(), and -1 with info
+// set if the file is broken, in which case the game goes on as it was.
+int reload_level(GameState* state, const char* path, LevelInfo* info) {
+    GameState level = { .engine = state->engine };
+    if (try_load_level(&level, path, info) != 0) {
+        free_game_state(&level);
+        return -1;
+    }
+    if (level.width != state->width || level.height != state->height) {
+        stop_worker_pool(state->pool);
+        free_game_state(state);
+        *state = level;
+        return 1;
+    }
+    reload_board(state, &level);
+    free_game_state(&level);
+    return 0;
+}
+
+// A pack of levels is a header, an index with an entry for every level, and the
+// levels, binary ones, one after the other. The header has a checksum of the index,
+// and every level its own. board_hash is the hash of the level's board, as the
+// level's header and load_board() have it, so it tells levels apart by their tiles.
+#define PACK_MAGIC "LTGP"
+#define PACK_VERSION 1
+#define PACK_HEADER_SIZE 24
+#define PACK_ENTRY_SIZE 64
+
+typedef struct {
+    uint64_t offset; // from the start of the pack
+    uint64_t size;
+    uint64_t board_hash;
+    uint32_t width; // like GameState.width, with the '\n' column
+    uint32_t height;
+    uint32_t gems;
+    char name[28]; // the file it was made from, without the directories
+} PackEntry;
+
+typedef struct {
+    const uint8_t* data; // the whole pack
+    size_t size;
+    int mapped; // by open_pack(), not built into the game
+    int count;
+    PackEntry* entries;
+} Pack;
+
+// Writes count loaded levels into a pack. Returns the size of the allocated *out.
+size_t write_pack(const GameState* levels, const char** names, int count, uint8_t** out) {
+    size_t size = PACK_HEADER_SIZE + (size_t)count * PACK_ENTRY_SIZE;
+    uint8_t* pack = allocate(size, 1);
+    for (int i = 0; i < count; ++i) {
+        uint8_t* level;
+        size_t level_size = write_binary_level(&levels[i], levels[i].front, &level);
+        pack = reallocate(pack, size + level_size);
+        memcpy(&pack[size], level, level_size);
+        free(level);
+        uint8_t* entry = &pack[PACK_HEADER_SIZE + (size_t)i * PACK_ENTRY_SIZE];
+        put_le(&entry[0], size, 8);
+        put_le(&entry[8], level_size, 8);
+        put_le(&entry[16], levels[i].board_hash, 8);
+        put_le(&entry[24], levels[i].width, 4);
+        put_le(&entry[28], levels[i].height, 4);
+        put_le(&entry[32], levels[i].level_gems, 4);
+        const char* slash = strrchr(names[i], '/');
+        strncpy((char*)&entry[36], slash ? slash + 1 : names[i], 27);
+        size += level_size;
+    }
+    memcpy(pack, PACK_MAGIC, 4);
+    put_le(&pack[4], PACK_VERSION, 4);
+    put_le(&pack[8], count, 4);
+    put_le(&pack[12], 0, 4);
+    put_le(&pack[16], level_checksum(CHECKSUM_SEED, &pack[PACK_HEADER_SIZE], (size_t)count * PACK_ENTRY_SIZE), 8);
+    *out = pack;
+    return size;
+}
+
+// Reads the index of a pack, the levels are only looked at by load_pack_level().
+int read_pack(Pack* pack, const uint8_t* data, size_t size, LevelInfo* info) {
+    *pack = (Pack){ .data = data, .size = size };
+    *info = (LevelInfo){};
+    if (size < PACK_HEADER_SIZE || memcmp(data, PACK_MAGIC, 4) != 0) return level_error(info, -1, 0, "not a pack of levels", 0);
+    if (get_le(&data[4], 4) != PACK_VERSION) return level_error(info, -1, 0, "unknown version of pack", 0);
+    uint64_t count = get_le(&data[8], 4);
+    if (count == 0 || count > (size - PACK_HEADER_SIZE) / PACK_ENTRY_SIZE) return level_error(info, -1, 0, "pack has a broken index", 0);
+    if (level_checksum(CHECKSUM_SEED, &data[PACK_HEADER_SIZE], count * PACK_ENTRY_SIZE) != get_le(&data[16], 8)) {
+        return level_error(info, -1, 0, "pack is damaged, checksum mismatch", 0);
+    }
+    pack->count = count;
+    pack->entries = allocate(count, sizeof(PackEntry));
+    for (uint64_t i = 0; i < count; ++i) {
+        const uint8_t* entry = &data[PACK_HEADER_SIZE + i * PACK_ENTRY_SIZE];
+        PackEntry* e = &pack->entries[i];
+        *e = (PackEntry){
+            .offset = get_le(&entry[0], 8), .size = get_le(&entry[8], 8), .board_hash = get_le(&entry[16], 8),
+            .width = get_le(&entry[24], 4), .height = get_le(&entry[28], 4), .gems = get_le(&entry[32], 4),
+        };
+        memcpy(e->name, &entry[36], sizeof(e->name) - 1);
+        if (e->offset > size || e->size > size - e->offset) return level_error(info, -1, 0, "pack has a level past its end", 0);
+    }
+    return 0;
+}
+
+int load_pack_level(GameState* state, const Pack* pack, int level, LevelInfo* info) {
+    const PackEntry* e = &pack->entries[level];
+    if (load_binary_level(state, &pack->data[e->offset], e->size, 0, info) != 0) return -1;
+    if ((uint32_t)state->width != e->width || (uint32_t)state->height != e->height || state->board_hash != e->board_hash) {
+        return level_error(info, -1, 0, "level is not the one in the index of the pack", 0);
+    }
+    return 0;
+}
+
+void open_pack(Pack* pack, const char* path) {
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0 || st.st_size == 0) {
+        fprintf(stderr, "Failed to open %s\n", path);
+        exit(EXIT_FAILURE);
+    }
+    void* data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    LevelInfo info;
+    if (data == MAP_FAILED) {
+        fprintf(stderr, "Failed to read %s\n", path);
+        exit(EXIT_FAILURE);
+    }
+    if (read_pack(pack, data, st.st_size, &info) != 0) {
+        fprintf(stderr, "%s: %s\n", path, info.error);
+        exit(EXIT_FAILURE);
+    }
+    pack->mapped = 1;
+}
+
+#ifdef EMBEDDED_PACK
+// Building with -DEMBEDDED_PACK=levels.pack puts a pack made by --make-pack into
+// the game, as read only data, so it can be played without any files around it.
+#define STRINGIFY(x) #x
+#define INCBIN(path) ".incbin \"" STRINGIFY(path) "\"\n"
+__asm__(".section .rodata\n.balign 8\nembedded_pack:\n" INCBIN(EMBEDDED_PACK) "embedded_pack_end:\n.previous\n");
+extern const uint8_t embedded_pack[], embedded_pack_end[];
+
+void open_embedded_pack(Pack* pack) {
+    LevelInfo info;
+    if (read_pack(pack, embedded_pack, embedded_pack_end - embedded_pack, &info) != 0) {
+        fprintf(stderr, "Built in pack %s: %s\n", STRINGIFY(EMBEDDED_PACK), info.error);
+        exit(EXIT_FAILURE);
+    }
+}
+#endif
+
+void close_pack(Pack* pack) {
+    if (pack->mapped) munmap((void*)pack->data, pack->size);
+    free(pack->entries);
+}
+
+// Loads a level of a pack on its own thread while the current one is played.
+// state.engine is set before it starts, settle is passed on to settle_level().
+typedef struct {
+    const Pack* pack;
+    int level;
+    long settle;
+    GameState state;
+    LevelInfo info;
+    int ret;
+    pthread_t thread;
+} Prefetch;
+
+void* prefetch_main(void* arg) {
+    Prefetch* prefetch = arg;
+    const PackEntry* e = &prefetch->pack->entries[prefetch->level];
+    uintptr_t page = sysconf(_SC_PAGESIZE), start = (uintptr_t)&prefetch->pack->data[e->offset];
+    madvise((void*)(start & ~(page - 1)), e->size + (start & (page - 1)), MADV_WILLNEED);
+    prefetch->ret = load_pack_level(&prefetch->state, prefetch->pack, prefetch->level, &prefetch->info);
+    if (prefetch->ret == 0 && prefetch->settle) settle_level(&prefetch->state, prefetch->settle);
+    return NULL;
+}
+
+void start_prefetch(Prefetch* prefetch, const Pack* pack, int level, int engine, long settle) {
+    *prefetch = (Prefetch){ .pack = pack, .level = level, .settle = settle, .state = { .engine = engine } };
+    pthread_create(&prefetch->thread, NULL, prefetch_main, prefetch);
+}
+
+// Waits for the level, usually long since loaded. Returns what load_pack_level() did.
+int finish_prefetch(Prefetch* prefetch) {
+    pthread_join(prefetch->thread, NULL);
+    return prefetch->ret;
+}
+
+// A replay is a header, the key of every tick, an index of keyframes and the keyframes.
+// The keys are in runs of the same key, each the key and the length of the run in 7 bit
+// groups like a run of chunks in a binary level. Most ticks have no key, so a long
+// session takes a few bytes per key press. Before the first tick and every
+// REPLAY_KEYFRAME_TICKS ticks after it a run ends and a keyframe is taken, the board
+// as a binary level, so seeking to a tick starts from the keyframe before it and only
+// plays the ticks in between. The file is mapped, and only that keyframe is read.
+// The header has the state_hash() of the game before the first tick, so a replay is
+// only played on the level it was recorded on, and the one after the last tick, which
+// the replay has to end on too, or the game no longer plays the way it was recorded.
+#define REPLAY_MAGIC "LTGR"
+#define REPLAY_VERSION 2
+#define REPLAY_HEADER_SIZE 80
+#define REPLAY_KEYFRAME_SIZE 48
+#define REPLAY_KEYFRAME_TICKS 1024
+
+typedef struct {
+    uint32_t engine; // the rules of ENGINE_TWO_BUFFER differ, so it is part of the game
+    uint32_t tick_us; // how long a tick was on screen
+    uint64_t settle; // --settle, before the first tick
+    uint64_t start_hash;
+    uint64_t ticks;
+    uint64_t end_hash;
+    uint64_t keys_size;
+    uint32_t keyframes;
+    uint32_t keyframe_ticks;
+    uint64_t frames_size; // of all the keyframes
+    uint64_t checksum; // level_checksum() of the header before it, the keys and the index
+} ReplayHeader;
+
+// The game between two ticks, what the board does not show of it is kept here.
+typedef struct {
+    uint64_t tick; // ticks before it
+    uint64_t keys_offset; // the run of keys that starts at tick, from the start of the keys
+    uint64_t frame_offset; // the board, from the start of the replay
+    uint64_t frame_size;
+    uint64_t state_hash;
+    uint32_t gems_collected;
+    uint32_t flags; // 1 dead, 2 won
+} Keyframe;
+
+typedef struct {
+    ReplayHeader header;
+    uint8_t* keys;
+    size_t size;
+    size_t capacity;
+    int key; // the run that is not in keys yet
+    uint64_t run;
+    Keyframe* keyframes; // frame_offset is from the start of frames
+    uint8_t* frames;
+    size_t frames_capacity;
+} Recording;
+
+void start_recording(Recording* recording, const GameState* state, uint32_t tick_us, long settle) {
+    *recording = (Recording){ .capacity = 256 };
+    recording->header = (ReplayHeader){
+        .engine = state->engine, .tick_us = tick_us, .settle = settle,
+        .start_hash = state_hash(state), .keyframe_ticks = REPLAY_KEYFRAME_TICKS,
+    };
+    recording->keys = allocate(recording->capacity, 1);
+}
+
+void end_key_run(Recording* recording) {
+    if (recording->run == 0) return;
+    if (recording->capacity - recording->size < 11) {
+        recording->capacity *= 2;
+        recording->keys = reallocate(recording->keys, recording->capacity);
+    }
+    recording->keys[recording->size++] = (uint8_t)recording->key;
+    uint64_t run = recording->run;
+    for (; run >= 0x80; run >>= 7) recording->keys[recording->size++] = (uint8_t)(run | 0x80);
+    recording->keys[recording->size++] = (uint8_t)run;
+    recording->run = 0;
+}
+
+// Called after swap_screens(), so the latest board is old_screen.
+void record_keyframe(Recording* recording, const GameState* state) {
+    end_key_run(recording);
+    ReplayHeader* h = &recording->header;
+    uint8_t* frame;
+    size_t size = write_binary_level(state, state->front ^ 1, &frame);
+    if (h->frames_size + size > recording->frames_capacity) {
+        recording->frames_capacity = 2 * (h->frames_size + size);
+        recording->frames = reallocate(recording->frames, recording->frames_capacity);
+    }
+    memcpy(&recording->frames[h->frames_size], frame, size);
+    free(frame);
+    recording->keyframes = reallocate(recording->keyframes, (h->keyframes + 1) * sizeof(Keyframe));
+    recording->keyframes[h->keyframes++] = (Keyframe){
+        .tick = h->ticks, .keys_offset = recording->size, .frame_offset = h->frames_size, .frame_size = size,
+        .state_hash = state_hash(state), .gems_collected = state->gems_collected, .flags = state->dead | state->won << 1,
+    };
+    h->frames_size += size;
+}
+
+// The key a tick starts with, once per tick, before the tick.
+void record_key(Recording* recording, const GameState* state, int key) {
+    if (recording->header.ticks % REPLAY_KEYFRAME_TICKS == 0) record_keyframe(recording, state);
+    if (recording->run && key != recording->key) end_key_run(recording);
+    recording->key = key;
+    ++recording->run;
+    ++recording->header.ticks;
+}
+
+// The replay of the game up to now, the game has to be between ticks.
+// Returns the size of the allocated *out.
+size_t write_replay(Recording* recording, const GameState* state, uint8_t** out) {
+    end_key_run(recording);
+    ReplayHeader* h = &recording->header;
+    h->end_hash = state_hash(state);
+    h->keys_size = recording->size;
+    size_t index = REPLAY_HEADER_SIZE + recording->size;
+    size_t frames = index + (size_t)h->keyframes * REPLAY_KEYFRAME_SIZE;
+    size_t size = frames + h->frames_size;
+    uint8_t* replay = allocate(size, 1);
+    memcpy(replay, REPLAY_MAGIC, 4);
+    put_le(&replay[4], REPLAY_VERSION, 4);
+    put_le(&replay[8], h->engine, 4);
+    put_le(&replay[12], h->tick_us, 4);
+    put_le(&replay[16], h->settle, 8);
+    put_le(&replay[24], h->start_hash, 8);
+    put_le(&replay[32], h->ticks, 8);
+    put_le(&replay[40], h->end_hash, 8);
+    put_le(&replay[48], h->keys_size, 8);
+    put_le(&replay[56], h->keyframes, 4);
+    put_le(&replay[60], h->keyframe_ticks, 4);
+    put_le(&replay[64], h->frames_size, 8);
+    memcpy(&replay[REPLAY_HEADER_SIZE], recording->keys, recording->size);
+    for (uint32_t i = 0; i < h->keyframes; ++i) {
+        const Keyframe* k = &recording->keyframes[i];
+        uint8_t* entry = &replay[index + (size_t)i * REPLAY_KEYFRAME_SIZE];
+        put_le(&entry[0], k->tick, 8);
+        put_le(&entry[8], k->keys_offset, 8);
+        put_le(&entry[16], frames + k->frame_offset, 8);
+        put_le(&entry[24], k->frame_size, 8);
+        put_le(&entry[32], k->state_hash, 8);
+        put_le(&entry[40], k->gems_collected, 4);
+        put_le(&entry[44], k->flags, 4);
+    }
+    memcpy(&replay[frames], recording->frames, h->frames_size);
+    uint64_t checksum = level_checksum(CHECKSUM_SEED, replay, REPLAY_HEADER_SIZE - 8);
+    put_le(&replay[72], level_checksum(checksum, &replay[REPLAY_HEADER_SIZE], frames - REPLAY_HEADER_SIZE), 8);
+    *out = replay;
+    return size;
+}
+
+void free_recording(Recording* recording) {
+    free(recording->keys);
+    free(recording->keyframes);
+    free(recording->frames);
+}
+
+typedef struct {
+    ReplayHeader header;
+    const uint8_t* data; // the whole replay
+    size_t size;
+    const uint8_t* keys;
+    const uint8_t* next; // the runs not played yet
+    const uint8_t* end;
+    int key;
+    uint64_t run; // ticks left in the current run
+    Keyframe* keyframes;
+} Replay;
+
+// Reads the next run, the runs were checked by read_replay().
+static void next_key_run(Replay* replay) {
+    replay->key = *replay->next++;
+    replay->run = 0;
+    for (int shift = 0; shift < 63; shift += 7) {
+        replay->run |= (uint64_t)(*replay->next & 0x7f) << shift;
+        if (!(*replay->next++ & 0x80)) break;
+    }
+}
+
+static int broken_replay(Replay* replay, LevelInfo* info, const char* message) {
+    free(replay->keyframes);
+    replay->keyframes = NULL;
+    return level_error(info, -1, 0, message, 0);
+}
+
+// Reads the header, the keys and the index, the keyframes are only looked at by seek_replay().
+int read_replay(Replay* replay, const uint8_t* data, size_t size, LevelInfo* info) {
+    *replay = (Replay){ .data = data, .size = size };
+    *info = (LevelInfo){};
+    if (size < REPLAY_HEADER_SIZE || memcmp(data, REPLAY_MAGIC, 4) != 0) return level_error(info, -1, 0, "not a replay", 0);
+    if (get_le(&data[4], 4) != REPLAY_VERSION) return level_error(info, -1, 0, "unknown version of replay", 0);
+    ReplayHeader* h = &replay->header;
+    *h = (ReplayHeader){
+        .engine = get_le(&data[8], 4), .tick_us = get_le(&data[12], 4), .settle = get_le(&data[16], 8),
+        .start_hash = get_le(&data[24], 8), .ticks = get_le(&data[32], 8), .end_hash = get_le(&data[40], 8),
+        .keys_size = get_le(&data[48], 8), .keyframes = get_le(&data[56], 4), .keyframe_ticks = get_le(&data[60], 4),
+        .frames_size = get_le(&data[64], 8), .checksum = get_le(&data[72], 8),
+    };
+    size_t rest = size - REPLAY_HEADER_SIZE, index_size = (size_t)h->keyframes * REPLAY_KEYFRAME_SIZE;
+    if (h->keys_size > rest || index_size > rest - h->keys_size || h->frames_size != rest - h->keys_size - index_size) {
+        return level_error(info, -1, 0, "replay is cut off", 0);
+    }
+    uint64_t checksum = level_checksum(CHECKSUM_SEED, data, REPLAY_HEADER_SIZE - 8);
+    if (level_checksum(checksum, &data[REPLAY_HEADER_SIZE], h->keys_size + index_size) != h->checksum) {
+        return level_error(info, -1, 0, "replay is damaged, checksum mismatch", 0);
+    }
+    if (h->engine > ENGINE_ENTITIES || h->settle > 0x7fffffff) return level_error(info, -1, 0, "replay has a broken header", 0);
+
+    // the runs have to add up to the ticks, so replay_key() can trust them,
+    // and every keyframe has to start a run at its tick
+    replay->keys = &data[REPLAY_HEADER_SIZE];
+    replay->keyframes = allocate(h->keyframes ? h->keyframes : 1, sizeof(Keyframe));
+    const uint8_t* index = replay->keys + h->keys_size;
+    uint64_t ticks = 0;
+    uint32_t keyframe = 0;
+    for (const uint8_t* p = replay->keys;; ) {
+        for (; keyframe < h->keyframes; ++keyframe) {
+            const uint8_t* entry = &index[(size_t)keyframe * REPLAY_KEYFRAME_SIZE];
+            Keyframe* k = &replay->keyframes[keyframe];
+            *k = (Keyframe){
+                .tick = get_le(&entry[0], 8), .keys_offset = get_le(&entry[8], 8), .frame_offset = get_le(&entry[16], 8),
+                .frame_size = get_le(&entry[24], 8), .state_hash = get_le(&entry[32], 8),
+                .gems_collected = get_le(&entry[40], 4), .flags = get_le(&entry[44], 4),
+            };
+            if (k->tick > ticks) break;
+            if (k->tick < ticks || k->keys_offset != (uint64_t)(p - replay->keys) || k->frame_offset < size - h->frames_size
+                    || k->frame_offset > size || k->frame_size > size - k->frame_offset) {
+                return broken_replay(replay, info, "replay has a broken keyframe");
+            }
+        }
+        if (p == index) break;
+        uint8_t key = *p++;
+        uint64_t run = 0;
+        int shift = 0, more = 1;
+        for (; p < index && more && shift < 63; shift += 7) {
+            run |= (uint64_t)(*p & 0x7f) << shift;
+            more = *p++ & 0x80;
+        }
+        if (key > 4 || more || run == 0 || run > h->ticks - ticks) return broken_replay(replay, info, "replay has a broken run of keys");
+        ticks += run;
+    }
+    if (ticks != h->ticks) return broken_replay(replay, info, "replay has too few keys");
+    if (keyframe != h->keyframes) return broken_replay(replay, info, "replay has a broken keyframe");
+    replay->next = replay->keys;
+    replay->end = index;
+    return 0;
+}
+
+// The key of the next tick, -1 after the last one.
+int replay_key(Replay* replay) {
+    if (replay->run == 0) {
+        if (replay->next == replay->end) return -1;
+        next_key_run(replay);
+    }
+    --replay->run;
+    return replay->key;
+}
+
+// Takes the game of a replay, between two ticks, to the given tick of the replay, or
+// its end. When there is a keyframe between the game and that tick, the game becomes
+// the keyframe, and only the ticks after it are played. The two buffer worker pool and
+// the view are kept. Returns the tick the ticks were played from, or -1 with info set
+// if the keyframe is broken.
+long seek_replay(GameState* state, Replay* replay, uint64_t tick, LevelInfo* info) {
+    if (tick > replay->header.ticks) tick = replay->header.ticks;
+    long from = state->count;
+    int found = -1;
+    for (uint32_t i = 0; i < replay->header.keyframes && replay->keyframes[i].tick <= tick; ++i) found = i;
+    if (found >= 0 && (replay->keyframes[found].tick > state->count || state->count > tick)) {
+        const Keyframe* k = &replay->keyframes[found];
+        GameState restored = { .engine = state->engine };
+        if (load_binary_level(&restored, &replay->data[k->frame_offset], k->frame_size, 0, info) != 0) {
+            free_game_state(&restored);
+            return -1;
+        }
+        restored.count = k->tick;
+        restored.gems_collected = k->gems_collected;
+        restored.dead = k->flags & 1;
+        restored.won = k->flags >> 1 & 1;
+        if (state_hash(&restored) != k->state_hash || restored.width != state->width || restored.height != state->height) {
+            free_game_state(&restored);
+            return level_error(info, -1, 0, "replay has a keyframe of another game", 0);
+        }
+        restored.pool = state->pool;
+        restored.view_width = state->view_width;
+        restored.view_height = state->view_height;
+        restored.view_x = state->view_x;
+        restored.view_y = state->view_y;
+        restored.redraw = 1;
+        free_game_state(state);
+        *state = restored;
+        replay->next = replay->keys + k->keys_offset;
+        replay->run = 0;
+        from = k->tick;
+    } else if (state->count > tick) {
+        return level_error(info, -1, 0, "replay can't seek back without a keyframe", 0);
+    }
+    while (state->count < tick) {
+        state->key = replay_key(replay);
+        update(state);
+        swap_screens(state);
+    }
+    return from;
+}
+
+void close_replay(Replay* replay) {
+    free(replay->keyframes);
+    if (replay->data) munmap((void*)replay->data, replay->size);
+}
+
+void open_replay(Replay* replay, const char* path) {
+    size_t size;
+    LevelInfo info;
+    char* data = map_level(path, &size, &info);
+    if (!data || read_replay(replay, (const uint8_t*)data, size, &info) != 0) exit_level_error(path, &info);
+    madvise(data, size, MADV_RANDOM); // past the keys only the keyframe seek_replay() needs is read
+}
+
+// Backspace, steps back a tick instead of playing one, see rewind_tick().
+#define REWIND_KEY 5
+#define REWIND_SIZE 65536
+
+// The last ticks as a ring of records, the oldest one dropped when a new one does not
+// fit. A record is what a tick changed, so it can be undone: the cells it wrote with
+// what they were before, and the player, gems and flags before it when they changed.
+// A cell is its index as the difference to the one before, zigzagged, with its tile in
+// the low 4 bits, in 7 bit groups, so most cells take a byte or two and a tick without
+// anything happening takes three, about 2 KB a minute. A record starts with its length
+// and ends with it backwards, so the ring can be walked from either end.
+typedef struct {
+    uint8_t* bytes;
+    uint64_t start; // the oldest record, offsets grow forever and wrap in bytes
+    uint64_t end;
+    // the tick being recorded
+    int pos_x;
+    int pos_y;
+    int gems_collected;
+    int flags; // 1 dead, 2 won
+    int64_t* cells;
+    char* tiles;
+    int count;
+    int capacity;
+    uint8_t* body; // the record of the tick, see rewind_body_size()
+} Rewind;
+
+// The longest record of a tick of capacity cells: the count, the player, gems and
+// flags, and every cell, each a varint of at most 10 bytes.
+static inline size_t rewind_body_size(int capacity) {
+    return 20 + 4 * 10 + (size_t)capacity * 10;
+}
+
+void start_rewind(Rewind* rewind) {
+    *rewind = (Rewind){ .capacity = 64 };
+    rewind->bytes = allocate(REWIND_SIZE, 1);
+    rewind->cells = allocate(rewind->capacity, sizeof(int64_t));
+    rewind->tiles = allocate(rewind->capacity, 1);
+    rewind->body = allocate(rewind_body_size(rewind->capacity), 1);
+}
+
+void free_rewind(Rewind* rewind) {
+    free(rewind->bytes);
+    free(rewind->cells);
+    free(rewind->tiles);
+    free(rewind->body);
+}
+
+// Room for one more cell in the tick.
+static void grow_rewind(Rewind* rewind) {
+    if (rewind->count < rewind->capacity) return;
+    rewind->capacity *= 2;
+    rewind->cells = reallocate(rewind->cells, rewind->capacity * sizeof(int64_t));
+    rewind->tiles = reallocate(rewind->tiles, rewind->capacity);
+    rewind->body = reallocate(rewind->body, rewind_body_size(rewind->capacity));
+}
+
+// Forgets every tick, after the board was changed some other way.
+void clear_rewind(Rewind* rewind) {
+    rewind->start = rewind->end;
+}
+
+// Before a tick, with the game between ticks.
+void begin_rewind_tick(Rewind* rewind, const GameState* state) {
+    rewind->pos_x = state->pos_x;
+    rewind->pos_y = state->pos_y;
+    rewind->gems_collected = state->gems_collected;
+    rewind->flags = state->dead | state->won << 1;
+    rewind->count = 0;
+}
+
+// After every update_slice() of the tick, before swap_screens(), while old_screen
+// still has what the written cells were before. A cell written by two slices is
+// kept twice and undone back to front, so it ends up as it was before the first.
+void add_rewind_cells(Rewind* rewind, const GameState* state) {
+    for (int k = 0; k < state->damage_count; ++k) {
+        int x = state->damage[k] % state->width;
+        int y = state->damage[k] / state->width;
+        char old = get_old_cell(state, x, y);
+        if (get_cell(state, x, y) == old) continue;
+        grow_rewind(rewind);
+        rewind->cells[rewind->count] = state->damage[k];
+        rewind->tiles[rewind->count++] = old;
+    }
+}
+
+static void put_rewind_varint(uint8_t* out, size_t* size, uint64_t value) {
+    for (; value >= 0x80; value >>= 7) out[(*size)++] = (uint8_t)(value | 0x80);
+    out[(*size)++] = (uint8_t)value;
+}
+
+static uint64_t get_rewind_varint(const Rewind* rewind, uint64_t* at) {
+    uint64_t value = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+        uint8_t b = rewind->bytes[(*at)++ % REWIND_SIZE];
+        value |= (uint64_t)(b & 0x7f) << shift;
+        if (!(b & 0x80)) break;
+    }
+    return value;
+}
+
+// After the tick, the record of it goes into the ring. A tick that writes more than
+// the ring holds can't be undone, and neither can the ones before it.
+void end_rewind_tick(Rewind* rewind, const GameState* state) {
+    int flags = state->dead | state->won << 1;
+    int moved = state->pos_x != rewind->pos_x || state->pos_y != rewind->pos_y
+        || state->gems_collected != rewind->gems_collected || flags != rewind->flags;
+    size_t size = 0;
+    uint8_t* body = rewind->body;
+    put_rewind_varint(body, &size, (uint64_t)rewind->count << 1 | moved);
+    if (moved) {
+        put_rewind_varint(body, &size, rewind->pos_x);
+        put_rewind_varint(body, &size, rewind->pos_y);
+        put_rewind_varint(body, &size, rewind->gems_collected);
+        put_rewind_varint(body, &size, rewind->flags);
+    }
+    int64_t last = 0;
+    for (int k = 0; k < rewind->count; ++k) {
+        int64_t delta = rewind->cells[k] - last;
+        uint64_t zigzag = (uint64_t)delta << 1 ^ (uint64_t)(delta >> 63);
+        put_rewind_varint(body, &size, zigzag << 4 | (tile_codes[(uint8_t)rewind->tiles[k]] - 1));
+        last = rewind->cells[k];
+    }
+    uint8_t length[10];
+    size_t length_size = 0;
+    put_rewind_varint(length, &length_size, size);
+    size_t record = size + 2 * length_size;
+    if (record > REWIND_SIZE) {
+        clear_rewind(rewind);
+    } else {
+        while (rewind->end + record - rewind->start > REWIND_SIZE) {
+            uint64_t at = rewind->start;
+            uint64_t oldest = get_rewind_varint(rewind, &at);
+            rewind->start = at + oldest + (at - rewind->start);
+        }
+        for (size_t i = 0; i < length_size; ++i) rewind->bytes[rewind->end++ % REWIND_SIZE] = length[i];
+        for (size_t i = 0; i < size; ++i) rewind->bytes[rewind->end++ % REWIND_SIZE] = body[i];
+        // backwards, the last 7 bits first, all but the first of them with the high bit
+        for (size_t i = length_size; i-- > 0;) {
+            rewind->bytes[rewind->end++ % REWIND_SIZE] = (uint8_t)((length[i] & 0x7f) | (i == length_size - 1 ? 0 : 0x80));
+        }
+    }
+}
+
+// Takes the game, between two ticks, back to before the newest tick in the ring, by
+// writing the cells back through set_cell(), like a tick would, so render() draws
+// only them. Returns 0 if there is no tick to undo.
+int rewind_tick(GameState* state, Rewind* rewind) {
+    sync_screens(state);
+    if (rewind->start == rewind->end) return 0;
+    uint64_t length = 0, at = rewind->end;
+    for (int shift = 0; shift < 64; shift += 7) {
+        uint8_t b = rewind->bytes[--at % REWIND_SIZE];
+        length |= (uint64_t)(b & 0x7f) << shift;
+        if (!(b & 0x80)) break;
+    }
+    uint64_t body = at - length;
+    rewind->end = body - (rewind->end - at);
+
+    at = body;
+    uint64_t head = get_rewind_varint(rewind, &at);
+    rewind->count = 0;
+    if (head & 1) {
+        state->pos_x = get_rewind_varint(rewind, &at);
+        state->pos_y = get_rewind_varint(rewind, &at);
+        state->gems_collected = get_rewind_varint(rewind, &at);
+        int flags = get_rewind_varint(rewind, &at);
+        state->dead = flags & 1;
+        state->won = flags >> 1 & 1;
+    }
+    // the cells back to front, a cell written twice ends up as it was first
+    int64_t last = 0;
+    for (uint64_t k = 0; k < head >> 1; ++k) {
+        uint64_t cell = get_rewind_varint(rewind, &at);
+        uint64_t zigzag = cell >> 4;
+        last += (int64_t)(zigzag >> 1) ^ -(int64_t)(zigzag & 1);
+        grow_rewind(rewind);
+        rewind->cells[rewind->count] = last;
+        rewind->tiles[rewind->count++] = packed_tiles[cell & 15];
+    }
+    for (int k = rewind->count; k-- > 0;) {
+        set_cell(state, rewind->cells[k] % state->width, rewind->cells[k] / state->width, rewind->tiles[k]);
+    }
+    rewind->count = 0;
+    if (state->engine == ENGINE_ENTITIES && state->prepared) sync_entities(state, 0);
+    --state->count;
+    return 1;
+}
+
+void print_end_message(GameState* state) {
+    printf("\e[%d;%dH", state->view_height + 2, 1); // move cursor
+    if (state->dead) {
+        printf("You died! Better luck next time!");
+    }
+    if (state->won) {
+        printf("You won! You collected %d of %d gems!", state->gems_collected, state->level_gems);
+    }
+}
+
+// Lower is faster
+#define SPEED 0.1
+// Seconds between frames of a replay played faster than it was recorded, the ticks
+// in between are drawn by the next frame, see skip_render().
+#define FRAME_TIME (1.0 / 30)
+
+static inline void add_seconds(struct timespec* t, double seconds) {
+    long ns = t->tv_nsec + (long)(seconds * 1e9), s = ns / 1000000000;
+    ns %= 1000000000;
+    if (ns < 0) {
+        ns += 1000000000;
+        --s;
+    }
+    t->tv_sec += s;
+    t->tv_nsec = ns;
+}
+
+static inline int is_before(const struct timespec* a, const struct timespec* b) {
+    return a->tv_sec < b->tv_sec || (a->tv_sec == b->tv_sec && a->tv_nsec < b->tv_nsec);
+}
+
+// Walls around the border, random rocks, gems, earth and space inside, one player.
+// width includes the '\n' column, so 4 by 3 is the smallest board with an inside.
+void random_board(char* board, int width, int height, unsigned int* seed, int* pos_x, int* pos_y) {
+    assert(width >= 4 && height >= 3);
+    const char* tiles = "   OOO$$.X";
+    for (int j = 0; j < height; ++j) {
+        for (int i = 0; i < width; ++i) {
+            *seed ^= *seed << 13;
+            *seed ^= *seed >> 17;
+            *seed ^= *seed << 5;
+            if (i == width - 1) {
+                board[j * width + i] = '\n';
+            } else if (j == 0 || j == height - 1 || i == 0 || i == width - 2) {
+                board[j * width + i] = 'X';
+            } else {
+                board[j * width + i] = tiles[*seed % 10];
+            }
+        }
+    }
+    *pos_x = 1 + *seed % (width - 3);
+    *pos_y = 1 + (*seed >> 8) % (height - 2);
+    board[*pos_y * width + *pos_x] = '@';
+}
+
+#ifndef RUN_TESTS
+
+typedef struct {
+    const char* level_path;
+    int headless;
+    const char* inputs_path; // headless: one key per tick, see read_headless_key()
+    unsigned int seed; // headless: random keys when there is no inputs file
+    long max_ticks; // headless: 0 means until the inputs run out
+    int engine;
+    int threads; // ENGINE_TWO_BUFFER only
+    long budget_cells; // physics per frame, see update_slice(), 0 for no limit
+    long budget_ns;
+    int bench_threads; // run the thread scaling benchmark from 1 to this many threads
+    int bench_width; // --bench-threads board, without the '\n' column
+    int bench_height;
+    int gen_lut;
+    long settle; // let the level settle for at most this many ticks before it starts
+    const char* convert_from; // write the level convert_from as convert_to, see convert_level()
+    const char* convert_to;
+    const char* pack_path; // play the levels of a pack one after the other
+    const char* make_pack; // write the pack_level_count levels of pack_levels into this pack
+    char** pack_levels;
+    int pack_level_count;
+    long memory_cap; // MB for the chunks of a streamed level, 0 to load the whole level
+    const char* record_path; // write a replay of the game here when it ends
+    const char* replay_path; // play the keys of this replay instead of reading them
+    long seek; // start the replay at this tick, -1 for its start
+    double speed; // play a replay this many times faster than it was recorded
+} Options;
+
+void print_usage(const char* name) {
+    fprintf(stderr, "Usage: %s [--engine scan|bitboard|lut|two-buffer|entities] [--threads N] [--gen-lut]\n"
+        "    [--budget-cells N] [--budget-us N] [--settle] [--memory-cap MB]\n"
+        "    [--headless [--inputs FILE | --seed N] [--ticks N]] [--bench-threads N [--ticks N] [--size WxH]]\n"
+        "    [--record REPLAY | --replay REPLAY [--seek TICK] [--speed N]]\n"
+        "    [LEVEL | --pack PACK]\n"
+        "       %s --convert LEVEL OUT\n"
+        "       %s --make-pack PACK LEVEL...\n", name, name, name);
+}
+
+void parse_options(int argc, char** argv, Options* options) {
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "--headless") == 0) {
+            options->headless = 1;
+        } else if (strcmp(argv[i], "--inputs") == 0 && i + 1 < argc) {
+            options->inputs_path = argv[++i];
+        } else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc) {
+            options->seed = strtoul(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--ticks") == 0 && i + 1 < argc) {
+            options->max_ticks = strtol(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--engine") == 0 && i + 1 < argc && strcmp(argv[i + 1], "scan") == 0) {
+            options->engine = ENGINE_SCAN;
+            ++i;
+        } else if (strcmp(argv[i], "--engine") == 0 && i + 1 < argc && strcmp(argv[i + 1], "bitboard") == 0) {
+            options->engine = ENGINE_BITBOARD;
+            ++i;
+        } else if (strcmp(argv[i], "--engine") == 0 && i + 1 < argc && strcmp(argv[i + 1], "lut") == 0) {
+            options->engine = ENGINE_LUT;
+            ++i;
+        } else if (strcmp(argv[i], "--engine") == 0 && i + 1 < argc && strcmp(argv[i + 1], "two-buffer") == 0) {
+            options->engine = ENGINE_TWO_BUFFER;
+            ++i;
+        } else if (strcmp(argv[i], "--engine") == 0 && i + 1 < argc && strcmp(argv[i + 1], "entities") == 0) {
+            options->engine = ENGINE_ENTITIES;
+            ++i;
+        } else if (strcmp(argv[i], "--budget-cells") == 0 && i + 1 < argc && atol(argv[i + 1]) > 0) {
+            options->budget_cells = atol(argv[++i]);
+        } else if (strcmp(argv[i], "--budget-us") == 0 && i + 1 < argc && atol(argv[i + 1]) > 0) {
+            options->budget_ns = atol(argv[++i]) * 1000;
+        } else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+            options->threads = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--bench-threads") == 0 && i + 1 < argc) {
+            options->bench_threads = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--size") == 0 && i + 1 < argc
+                && sscanf(argv[i + 1], "%dx%d", &options->bench_width, &options->bench_height) == 2
+                && options->bench_width >= 3 && options->bench_height >= 3) {
+            ++i;
+        } else if (strcmp(argv[i], "--settle") == 0) {
+            options->settle = 100000;
+        } else if (strcmp(argv[i], "--memory-cap") == 0 && i + 1 < argc && atol(argv[i + 1]) > 0) {
+            options->memory_cap = atol(argv[++i]);
+        } else if (strcmp(argv[i], "--record") == 0 && i + 1 < argc) {
+            options->record_path = argv[++i];
+        } else if (strcmp(argv[i], "--replay") == 0 && i + 1 < argc) {
+            options->replay_path = argv[++i];
+        } else if (strcmp(argv[i], "--seek") == 0 && i + 1 < argc && atol(argv[i + 1]) >= 0) {
+            options->seek = atol(argv[++i]);
+        } else if (strcmp(argv[i], "--speed") == 0 && i + 1 < argc && atof(argv[i + 1]) >= 1 && atof(argv[i + 1]) <= 1000) {
+            options->speed = atof(argv[++i]);
+        } else if (strcmp(argv[i], "--convert") == 0 && i + 2 < argc) {
+            options->convert_from = argv[++i];
+            options->convert_to = argv[++i];
+        } else if (strcmp(argv[i], "--pack") == 0 && i + 1 < argc) {
+            options->pack_path = argv[++i];
+        } else if (strcmp(argv[i], "--make-pack") == 0 && i + 2 < argc) {
+            options->make_pack = argv[++i];
+            options->pack_levels = &argv[i + 1];
+            options->pack_level_count = argc - i - 1;
+            break;
+        } else if (strcmp(argv[i], "--gen-lut") == 0) {
+            options->gen_lut = 1;
+        } else if (argv[i][0] != '-') {
+            options->level_path = argv[i];
+        } else {
+            print_usage(argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+}
+
+// xorshift32, so a seed always replays the same keys
+int next_random_key(unsigned int* seed) {
+    unsigned int x = *seed;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    *seed = x;
+    return x % 5; // 0 is "no key", 1-4 are the arrows
+}
+
+// Inputs file: one character per tick, U D R L for the arrows,
+// anything else (e.g. '.') is a tick without a key. Whitespace is skipped.
+// Returns -1 when the file is exhausted.
+int read_headless_key(FILE* inputs) {
+    int c;
+    do {
+        c = fgetc(inputs);
+    } while (c == ' ' || c == '\n' || c == '\r' || c == '\t');
+    switch (c) {
+        case EOF: return -1;
+        case 'U': case 'u': return 1;
+        case 'D': case 'd': return 2;
+        case 'R': case 'r': return 3;
+        case 'L': case 'l': return 4;
+        default: return 0;
+    }
+}
+
+int write_file(const char* path, const void* data, size_t size) {
+    FILE* f = fopen(path, "wb");
+    int ok = f && fwrite(data, 1, size, f) == size;
+    if (f && fclose(f) != 0) ok = 0;
+    if (!ok) fprintf(stderr, "Failed to write %s\n", path);
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+// Writes a level, text or binary, as a text level if to ends in ".txt" and as a binary one otherwise.
+// With settle, the level is settled first, see settle_level(), as streamed levels should be.
+int convert_level(const char* from, const char* to, long settle) {
+    GameState state = {};
+    load_level(&state, from);
+    long ticks = settle ? settle_level(&state, settle) : 0;
+    if (ticks < 0) {
+        fprintf(stderr, "Not settling the level, a rock or gem would fall on the player\n");
+    } else if (settle && ticks == settle) {
+        fprintf(stderr, "Level still moving after %ld ticks of settling, it can't be streamed\n", ticks);
+    }
+    size_t length = strlen(to), size;
+    uint8_t* level;
+    if (length >= 4 && strcmp(&to[length - 4], ".txt") == 0) {
+        size = board_size(&state);
+        level = allocate(size, 1);
+        copy_board(&state, state.front, (char*)level);
+    } else {
+        size = write_binary_level(&state, state.front, &level);
+    }
+    int ret = write_file(to, level, size);
+    free(level);
+    free_game_state(&state);
+    return ret;
+}
+
+// Packs levels, text or binary, in the order they are given.
+int make_pack(const char* to, char** paths, int count) {
+    GameState* levels = allocate(count, sizeof(GameState));
+    for (int i = 0; i < count; ++i) load_level(&levels[i], paths[i]);
+    uint8_t* pack;
+    size_t size = write_pack(levels, (const char**)paths, count, &pack);
+    int ret = write_file(to, pack, size);
+    for (int i = 0; i < count; ++i) free_game_state(&levels[i]);
+    free(levels);
+    free(pack);
+    return ret;
+}
+
+// --record: the game has to be between ticks, a tick that is not done yet is finished first.
+int save_recording(Recording* recording, GameState* state, const char* path) {
+    while (state->mid_pass) update_slice(state, 0, 0);
+    uint8_t* replay;
+    size_t size = write_replay(recording, state, &replay);
+    int ret = write_file(path, replay, size);
+    free(replay);
+    free_recording(recording);
+    return ret;
+}
+
+// --pack: pack.entries[level] is played while the level after it is loaded.
+typedef struct {
+    Pack pack;
+    int level;
+    Prefetch next;
+    int prefetching;
+    int threads; // for the worker pool of every level
+    long settle;
+} PackPlay;
+
+void start_pack(GameState* state, PackPlay* play) {
+    LevelInfo info;
+    if (load_pack_level(state, &play->pack, 0, &info) != 0) {
+        fprintf(stderr, "%s: %s\n", play->pack.entries[0].name, info.error);
+        exit(EXIT_FAILURE);
+    }
+    play->prefetching = play->pack.count > 1;
+    if (play->prefetching) start_prefetch(&play->next, &play->pack, 1, state->engine, play->settle);
+}
+
+// Once a level is won, the game goes on with the next one. Returns 0 after the last level.
+int next_level(GameState* state, PackPlay* play) {
+    if (!play->prefetching) return 0;
+    if (finish_prefetch(&play->next) != 0) {
+        fprintf(stderr, "%s: %s\n", play->pack.entries[play->next.level].name, play->next.info.error);
+        exit(EXIT_FAILURE);
+    }
+    stop_worker_pool(state->pool);
+    free_game_state(state);
+    *state = play->next.state;
+    if (state->engine == ENGINE_TWO_BUFFER && play->threads > 1) {
+        state->pool = start_worker_pool(play->threads, state->width, state->height);
+    }
+    ++play->level;
+    play->prefetching = play->level + 1 < play->pack.count;
+    if (play->prefetching) start_prefetch(&play->next, &play->pack, play->level + 1, state->engine, play->settle);
+    return 1;
+}
+
+void stop_pack(PackPlay* play) {
+    if (play->prefetching) {
+        finish_prefetch(&play->next);
+        free_game_state(&play->next.state);
+    }
+    close_pack(&play->pack);
+}
+
+// Watches the level file while it is played, so it can be edited on the side, see
+// reload_level(). Editors often write a new file and rename it over the old one,
+// which a watch on the file itself would not see, so the directory is watched.
+typedef struct {
+    int fd; // inotify, -1 when not watching
+    char dir[4096];
+    const char* name; // of the file in dir
+} LevelWatch;
+
+void start_level_watch(LevelWatch* watch, const char* path) {
+    const char* slash = strrchr(path, '/');
+    snprintf(watch->dir, sizeof(watch->dir), "%.*s", slash ? (int)(slash - path) + 1 : 2, slash ? path : "./");
+    watch->name = slash ? slash + 1 : path;
+    watch->fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (watch->fd >= 0 && inotify_add_watch(watch->fd, watch->dir, IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+        close(watch->fd);
+        watch->fd = -1;
+    }
+}
+
+// Whether the file was written since the last call, without waiting.
+int level_changed(LevelWatch* watch) {
+    if (watch->fd < 0) return 0;
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    int changed = 0;
+    ssize_t n;
+    while ((n = read(watch->fd, buf, sizeof(buf))) > 0) {
+        for (char* p = buf; p < buf + n; p += sizeof(struct inotify_event) + ((struct inotify_event*)p)->len) {
+            const struct inotify_event* event = (const struct inotify_event*)p;
+            if (event->len && strcmp(event->name, watch->name) == 0) changed = 1;
+        }
+    }
+    return changed;
+}
+
+void stop_level_watch(LevelWatch* watch) {
+    if (watch->fd >= 0) close(watch->fd);
+}
+
+// Under the board, where print_end_message() goes too.
+void print_reload_message(const GameState* state, const char* path, const LevelInfo* info) {
+    printf("\e[%d;%dH\e[K", state->view_height + 2, 1);
+    if (!info) return;
+    if (info->line) {
+        printf("%s:%ld:%ld: %s", path, info->line, info->column, info->error);
+    } else {
+        printf("%s: %s", path, info->error);
+    }
+}
+
+// Called after swap_screens(), so the latest board is old_screen.
+void print_board(GameState* state) {
+    char* tiles = allocate(board_size(state), 1);
+    copy_board(state, state->front ^ 1, tiles);
+    fwrite(tiles, 1, board_size(state), stdout);
+    free(tiles);
+}
+
+// Runs the simulation as fast as possible without touching the terminal.
+// play is NULL unless the levels come from a pack, replay unless the keys come
+// from a replay, and recording unless the keys are recorded.
+int run_headless(GameState* state, Options* options, PackPlay* play, Replay* replay, Recording* recording) {
+    FILE* inputs = NULL;
+    if (options->inputs_path) {
+        inputs = fopen(options->inputs_path, "r");
+        if (!inputs) {
+            fprintf(stderr, "Failed to open %s\n", options->inputs_path);
+            return EXIT_FAILURE;
+        }
+    } else if (options->max_ticks == 0 && !replay) {
+        options->max_ticks = 10000; // the generator never runs out
+    }
+    unsigned int seed = options->seed ? options->seed : 1; // xorshift can't start from 0
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    long ticks = 0, frames = 0;
+    double longest_frame = 0;
+    while (options->max_ticks == 0 || ticks < options->max_ticks) {
+        int key = replay ? replay_key(replay) : inputs ? read_headless_key(inputs) : next_random_key(&seed);
+        if (key < 0) break;
+        state->key = key;
+        if (recording) record_key(recording, state, key);
+        int done;
+        do {
+            struct timespec frame_start, frame_end;
+            clock_gettime(CLOCK_MONOTONIC, &frame_start);
+            done = update_slice(state, options->budget_cells, options->budget_ns);
+            swap_screens(state);
+            clock_gettime(CLOCK_MONOTONIC, &frame_end);
+            double frame = (frame_end.tv_sec - frame_start.tv_sec) + (frame_end.tv_nsec - frame_start.tv_nsec) / 1e9;
+            if (frame > longest_frame) longest_frame = frame;
+            ++frames;
+        } while (!done);
+        ++ticks;
+        if (state->won && play && next_level(state, play)) continue;
+        if (state->won || state->dead) break;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    if (inputs) fclose(inputs);
+
+    double elapsed = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    print_board(state);
+    printf("ticks: %ld, elapsed: %.6f s, ticks/sec: %.0f\n",
+        ticks, elapsed, elapsed > 0 ? ticks / elapsed : 0.0);
+    printf("player: (%d, %d), gems: %d, %s\n", state->pos_x, state->pos_y, state->gems_collected,
+        state->won ? "won" : state->dead ? "dead" : "playing");
+    printf("hash: %016llx\n", (unsigned long long)state_hash(state));
+    if (play) printf("level: %d of %d, %s\n", play->level + 1, play->pack.count, play->pack.entries[play->level].name);
+    if (state->stream) printf("chunks: %ld resident, %ld evicted\n", state->resident_chunks, state->stream->evicted);
+    if (options->budget_cells || options->budget_ns) printf("frames: %ld, longest: %.6f s\n", frames, longest_frame);
+    if (state->engine == ENGINE_ENTITIES) {
+        int gems, falling;
+        count_entities(&state->entities, &gems, &falling);
+        printf("entities: %d rocks, %d gems, %d falling\n", state->entities.count - gems, gems, falling);
+    }
+    // only a replay played to its end can be checked
+    if (replay && state->count == replay->header.ticks) {
+        int same = state_hash(state) == replay->header.end_hash;
+        printf("replay: %s\n", same ? "ends where it was recorded" : "DIFFERENT from the recording");
+        if (!same) return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
+
+// Runs ENGINE_TWO_BUFFER on the same random board with 1 to max_threads threads.
+// Every run has to end with the board of the single threaded one.
+int run_thread_benchmark(int max_threads, long ticks, int width, int height) {
+    size_t size = (size_t)width * height;
+    char* board = allocate(size, 1);
+    char* reference = allocate(size, 1);
+    char* result = allocate(size, 1);
+    unsigned int seed = 1;
+    int pos_x, pos_y;
+    random_board(board, width, height, &seed, &pos_x, &pos_y);
+    if (ticks == 0) ticks = 200;
+
+    printf("board: %dx%d, ticks: %ld\n", width - 1, height, ticks);
+    double single = 0;
+    int ret = EXIT_SUCCESS;
+    for (int threads = 1; threads <= max_threads && ret == EXIT_SUCCESS; ++threads) {
+        GameState state = { .engine = ENGINE_TWO_BUFFER };
+        init_game_state(&state, width, height);
+        state.pos_x = pos_x;
+        state.pos_y = pos_y;
+        load_board(&state, board);
+        state.pool = start_worker_pool(threads, width, height);
+
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (long t = 0; t < ticks; ++t) {
+            update(&state);
+            swap_screens(&state);
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        stop_worker_pool(state.pool);
+
+        double elapsed = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+        if (threads == 1) {
+            single = elapsed;
+            copy_board(&state, state.front ^ 1, reference);
+        }
+        copy_board(&state, state.front ^ 1, result);
+        int identical = memcmp(reference, result, size) == 0;
+        printf("threads: %d, ticks/sec: %.0f, speedup: %.2fx, %s\n", threads, ticks / elapsed,
+            single / elapsed, identical ? "identical" : "DIFFERENT");
+        if (!identical) ret = EXIT_FAILURE;
+        free_game_state(&state);
+    }
+    free(board);
+    free(reference);
+    free(result);
+    return ret;
+}
+
+int main(int argc, char** argv) {
+    Options options = { .bench_width = 256, .bench_height = 4000, .seek = -1, .speed = 1 };
+    parse_options(argc, argv, &options);
+
+    if (options.gen_lut) {
+        print_physics_lut();
+        return EXIT_SUCCESS;
+    }
+
+    if (options.convert_from) {
+        return convert_level(options.convert_from, options.convert_to, options.settle);
+    }
+
+    if (options.make_pack) {
+        return make_pack(options.make_pack, options.pack_levels, options.pack_level_count);
+    }
+
+    if (options.bench_threads) {
+        return run_thread_benchmark(options.bench_threads, options.max_ticks,
+            options.bench_width + 1, options.bench_height);
+    }
+
+    if (options.memory_cap && (options.pack_path || options.settle
+            || (options.engine != ENGINE_SCAN && options.engine != ENGINE_LUT))) {
+        fprintf(stderr, "--memory-cap streams a single level, with the scan or lut engine and without --settle\n");
+        return EXIT_FAILURE;
+    }
+    if (options.seek >= 0 && (!options.replay_path || options.record_path || options.memory_cap)) {
+        fprintf(stderr, "--seek takes a replay, without --record or --memory-cap\n");
+        return EXIT_FAILURE;
+    }
+    if (options.speed != 1 && !options.replay_path) {
+        fprintf(stderr, "--speed takes a replay\n");
+        return EXIT_FAILURE;
+    }
+
+    // a replay is played with the rules and the start it was recorded with
+    Replay replay = {};
+    if (options.replay_path) {
+        open_replay(&replay, options.replay_path);
+        options.engine = replay.header.engine;
+        options.settle = replay.header.settle;
+    }
+
+    const char* level_path = options.level_path ? options.level_path : "./level_1.txt";
+    GameState state = {};
+    state.engine = options.engine;
+    PackPlay play = { .threads = options.threads, .settle = options.settle };
+#ifdef EMBEDDED_PACK
+    if (!options.pack_path && !options.level_path) open_embedded_pack(&play.pack);
+#endif
+    if (options.pack_path) open_pack(&play.pack, options.pack_path);
+    if (play.pack.data && (options.record_path || options.replay_path)) {
+        fprintf(stderr, "--record and --replay take a single level, not a pack\n");
+        return EXIT_FAILURE;
+    }
+    if (play.pack.data) {
+        start_pack(&state, &play);
+    } else if (options.memory_cap) {
+        long max_resident = (options.memory_cap << 20) / sizeof(ChunkData);
+        stream_level(&state, level_path, max_resident);
+    } else {
+        load_level(&state, level_path);
+    }
+    if (options.engine == ENGINE_TWO_BUFFER && options.threads > 1) {
+        state.pool = start_worker_pool(options.threads, state.width, state.height);
+    }
+    if (options.settle) {
+        long ticks = settle_level(&state, options.settle);
+        if (ticks < 0) {
+            fprintf(stderr, "Not settling the level, a rock or gem would fall on the player\n");
+        } else if (ticks == options.settle) {
+            fprintf(stderr, "Level still moving after %ld ticks of settling\n", ticks);
+        } else {
+            fprintf(stderr, "Level settled after %ld ticks\n", ticks);
+        }
+    }
+    if (replay.data && state_hash(&state) != replay.header.start_hash) {
+        fprintf(stderr, "%s was recorded on another level than %s\n", options.replay_path, level_path);
+        return EXIT_FAILURE;
+    }
+    if (options.seek >= 0) {
+        LevelInfo info;
+        long from = seek_replay(&state, &replay, options.seek, &info);
+        if (from < 0) exit_level_error(options.replay_path, &info);
+        fprintf(stderr, "Replay at tick %u of %llu, played from tick %ld\n", state.count,
+            (unsigned long long)replay.header.ticks, from);
+    }
+    Recording recording = {};
+    if (options.record_path) start_recording(&recording, &state, SPEED * 1000000, options.settle);
+
+    if (options.headless) {
+        int ret = run_headless(&state, &options, play.pack.data ? &play : NULL,
+            replay.data ? &replay : NULL, recording.keys ? &recording : NULL);
+        if (recording.keys && save_recording(&recording, &state, options.record_path) != EXIT_SUCCESS) ret = EXIT_FAILURE;
+        stop_worker_pool(state.pool);
+        if (play.pack.data) stop_pack(&play);
+        close_replay(&replay);
+        return ret;
+    }
+
+    configure_terminal();
+
+    signal(SIGINT, signal_handler);
+
+    struct timespec req = {};
+    struct timespec rem = {};
+
+    printf("\e[2J");
+    init_view(&state);
+    render(&state); // To display the level
+
+    // a level file of its own, not a pack or a streamed level, is reloaded when it changes,
+    // unless that would take the game somewhere the keys of a replay don't
+    LevelWatch watch = { .fd = -1 };
+    if (!play.pack.data && !state.stream && !replay.data && !recording.keys) start_level_watch(&watch, level_path);
+    double tick_time = replay.data ? replay.header.tick_us / 1e6 / options.speed : SPEED;
+    // a fast forward keeps the ticks to a clock of its own and draws at most every FRAME_TIME
+    int fast_forward = options.speed > 1;
+    struct timespec next_tick, next_frame;
+    clock_gettime(CLOCK_MONOTONIC, &next_tick);
+    next_frame = next_tick;
+    int last_key = 0; // the replay has no more keys after this tick
+    // the keys of a recording or a replay would no longer be the game after a rewind
+    Rewind rewind = {};
+    if (!replay.data && !recording.keys) start_rewind(&rewind);
+
+    clock_t start, end;
+
+    while (!exit_loop) {
+        start = clock();
+
+        read_input(&state);
+        if (state.key == REWIND_KEY && (!rewind.bytes || state.mid_pass)) state.key = 0;
+        if (replay.data && !state.mid_pass) {
+            int key = replay_key(&replay);
+            if (key < 0) break;
+            state.key = key;
+            last_key = replay.run == 0 && replay.next == replay.end;
+        }
+        if (recording.keys && !state.mid_pass) record_key(&recording, &state, state.key);
+        int done = 1;
+        if (state.key == REWIND_KEY) {
+            state.key = 0;
+            rewind_tick(&state, &rewind);
+        } else {
+            if (rewind.bytes && !state.mid_pass) begin_rewind_tick(&rewind, &state);
+            done = update_slice(&state, options.budget_cells, options.budget_ns);
+            if (rewind.bytes) add_rewind_cells(&rewind, &state);
+            if (rewind.bytes && done) end_rewind_tick(&rewind, &state);
+        }
+        if (done && level_changed(&watch)) {
+            LevelInfo info;
+            int ret = reload_level(&state, level_path, &info);
+            if (ret >= 0) clear_rewind(&rewind);
+            if (ret == 1) {
+                if (options.engine == ENGINE_TWO_BUFFER && options.threads > 1) {
+                    state.pool = start_worker_pool(options.threads, state.width, state.height);
+                }
+                printf("\e[2J");
+                init_view(&state);
+            }
+            print_reload_message(&state, level_path, ret < 0 ? &info : NULL);
+            if (ret == 1) {
+                render(&state);
+                continue;
+            }
+        }
+        if (state.won && play.pack.data && next_level(&state, &play)) {
+            clear_rewind(&rewind);
+            printf("\e[2J");
+            init_view(&state);
+            render(&state);
+            continue;
+        }
+        if (state.dead && rewind.start != rewind.end) {
+            // the game is over unless the death is undone
+            render(&state);
+            print_end_message(&state);
+            printf(" Backspace rewinds.");
+            fflush(stdout);
+            swap_screens(&state);
+            for (read_input(&state); !exit_loop && state.key != REWIND_KEY; read_input(&state)) {
+                req = (struct timespec){ .tv_nsec = 10000000 };
+                nanosleep(&req, &rem);
+            }
+            if (exit_loop) break;
+            printf("\e[%d;%dH\e[K", state.view_height + 2, 1);
+            rewind_tick(&state, &rewind);
+            render(&state);
+            swap_screens(&state);
+            continue;
+        }
+        if (state.won || state.dead) {
+            if (fast_forward) render(&state); // the skipped ticks
+            print_end_message(&state);
+            break;
+        }
+
+        if (fast_forward) {
+            struct timespec now;
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            if (is_before(&now, &next_frame) && !(done && last_key)) {
+                skip_render(&state);
+            } else {
+                render(&state);
+                next_frame = now;
+                add_seconds(&next_frame, FRAME_TIME);
+            }
+            swap_screens(&state);
+            if (!done) continue;
+            // when the ticks can't keep up they run flat out, without catching up later
+            add_seconds(&now, -FRAME_TIME);
+            if (is_before(&next_tick, &now)) next_tick = now;
+            add_seconds(&next_tick, tick_time);
+            clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next_tick, NULL);
+            continue;
+        }
+
+        render(&state);
+
+        swap_screens(&state);
+
+        end = clock();
+
+        double time_taken = ((double)(end - start)) / CLOCKS_PER_SEC;
+        if (time_taken > tick_time) continue;
+
+        req.tv_sec = 0;
+        req.tv_nsec = (tick_time - time_taken) * 1000000000; // 0.1 seconds
+        nanosleep(&req, &rem);
+    }
+    if (replay.data && state.count == replay.header.ticks) {
+        printf("\e[%d;%dH\e[K", state.view_height + 3, 1);
+        printf(state_hash(&state) == replay.header.end_hash ? "The replay ends where it was recorded"
+            : "The replay does not end where it was recorded!");
+    }
+    stop_level_watch(&watch);
+    if (play.pack.data) stop_pack(&play);
+    close_replay(&replay);
+    free_rewind(&rewind);
+    if (recording.keys) return save_recording(&recording, &state, options.record_path);
+}
+
+#endif
+
+#ifdef RUN_TESTS
+
+// memcmp() of screen, laid out like the level file, and expected.
+int compare_screen(GameState* state, const void* expected) {
+    char* tiles = allocate(board_size(state), 1);
+    copy_board(state, state->front, tiles);
+    int ret = memcmp(tiles, expected, board_size(state));
+    free(tiles);
+    return ret;
+}
+
+int test_player_lives() {
+    char level[4][5] = {
+        {'X', 'X', 'X', 'X', '\n'},
+        {'X', 'O', 'O', 'X', '\n'},
+        {'X', '@', '.', 'X', '\n'},
+        {'X', 'X', 'X', 'X', '\n'}
+    };
+
+    GameState state = {
+        .key = 3,
+        .pos_x = 1,
+        .pos_y = 2,
     };
+    init_game_state(&state, 5, 4);
+    load_board(&state, &level[0][0]);
 
     char expected1[4][5] = {
         {'X', 'X', 'X', 'X', '\n'},
@@ -463,112 +3910,1247 @@ int test_player_lives() {
         {'X', 'X', 'X', 'X', '\n'}
     };
 
-    update(&state);
-    int ret = memcmp(state.screen, expected1, sizeof(expected1));
-    if (ret != 0) {
-        printf("\e[38;2;250;10;10mState after update() is not equal to expected1\n");
-        // memset(state.old_screen, '?', sizeof(state.old_screen));
-        // render(&state);
+    update(&state);
+    int ret = compare_screen(&state, expected1);
+    if (ret != 0) {
+        printf("\e[38;2;250;10;10mState after update() is not equal to expected1\n");
+        // init_view(&state);
+        // render(&state);
+        return 1;
+    }
+    swap_screens(&state);
+    state.key = 0;
+
+    update(&state);
+    ret = compare_screen(&state, expected2);
+    if (ret != 0) {
+        printf("\e[38;2;250;10;10mState after update() is not equal to expected2\n");
+        return 1;
+    }
+    swap_screens(&state);
+
+    update(&state);
+    ret = compare_screen(&state, expected3);
+    if (ret != 0) {
+        printf("\e[38;2;250;10;10mState after update() is not equal to expected3\n");
+        return 1;
+    }
+    swap_screens(&state);
+
+    free_game_state(&state);
+    return 0;
+}
+
+int test_rock_rolls() {
+    char level[4][5] = {
+        {'X', 'X', 'X', 'X', '\n'},
+        {'X', ' ', 'O', 'X', '\n'},
+        {'X', ' ', 'O', 'X', '\n'},
+        {'X', 'X', 'X', 'X', '\n'}
+    };
+
+    GameState state = {
+        .key = 0,
+        .pos_x = 0,
+        .pos_y = 0,
+    };
+    init_game_state(&state, 5, 4);
+    load_board(&state, &level[0][0]);
+
+    char expected1[4][5] = {
+        {'X', 'X', 'X', 'X', '\n'},
+        {'X', ' ', 'o', 'X', '\n'},
+        {'X', ' ', 'O', 'X', '\n'},
+        {'X', 'X', 'X', 'X', '\n'}
+    };
+
+    char expected2[4][5] = {
+        {'X', 'X', 'X', 'X', '\n'},
+        {'X', 'o', ' ', 'X', '\n'},
+        {'X', ' ', 'O', 'X', '\n'},
+        {'X', 'X', 'X', 'X', '\n'}
+    };
+
+    char expected3[4][5] = {
+        {'X', 'X', 'X', 'X', '\n'},
+        {'X', ' ', ' ', 'X', '\n'},
+        {'X', 'o', 'O', 'X', '\n'},
+        {'X', 'X', 'X', 'X', '\n'}
+    };
+
+    char expected4[4][5] = {
+        {'X', 'X', 'X', 'X', '\n'},
+        {'X', ' ', ' ', 'X', '\n'},
+        {'X', 'O', 'O', 'X', '\n'},
+        {'X', 'X', 'X', 'X', '\n'}
+    };
+
+    update(&state);
+    int ret = compare_screen(&state, expected1);
+    if (ret != 0) {
+        printf("\e[38;2;250;10;10mState after update() is not equal to expected1\n");
+        // init_view(&state);
+        // render(&state);
+        return 1;
+    }
+    swap_screens(&state);
+
+    update(&state);
+    ret = compare_screen(&state, expected2);
+    if (ret != 0) {
+        printf("\e[38;2;250;10;10mState after update() is not equal to expected2\n");
+        init_view(&state);
+        render(&state);
+        return 1;
+    }
+    swap_screens(&state);
+
+    update(&state);
+    ret = compare_screen(&state, expected3);
+    if (ret != 0) {
+        printf("\e[38;2;250;10;10mState after update() is not equal to expected3\n");
+        return 1;
+    }
+    swap_screens(&state);
+
+    update(&state);
+    ret = compare_screen(&state, expected4);
+    if (ret != 0) {
+        printf("\e[38;2;250;10;10mState after update() is not equal to expected4\n");
+        return 1;
+    }
+
+    free_game_state(&state);
+    return 0;
+}
+
+int test_resting_rocks_sleep() {
+    char level[4][5] = {
+        {'X', 'X', 'X', 'X', '\n'},
+        {'X', '$', ' ', 'X', '\n'},
+        {'X', 'O', 'O', 'X', '\n'},
+        {'X', 'X', 'X', 'X', '\n'}
+    };
+
+    GameState state = {
+        .key = 0,
+        .pos_x = 0,
+        .pos_y = 0,
+    };
+    init_game_state(&state, 5, 4);
+    load_board(&state, &level[0][0]);
+
+    update(&state);
+    swap_screens(&state);
+
+    if (state.awake_chunks[0] != 0 || state.awake_bands[0] != 0) { // the board is one chunk
+        printf("\e[38;2;250;10;10mResting rocks are still active after update()\n");
+        return 1;
+    }
+
+    // digging next to the gem has to wake it up again
+    set_cell(&state, 2, 2, ' ');
+    swap_screens(&state);
+    update(&state);
+    if (get_cell(&state, 1, 1) != 'S') {
+        printf("\e[38;2;250;10;10mGem did not start to roll after its neighbor changed\n");
+        return 1;
+    }
+
+    free_game_state(&state);
+    return 0;
+}
+
+// Mostly small boards, where the walls are never far, and every eighth one
+// wide enough for 2, 3 or 4 words per bitboard row and a few rows of chunks.
+void random_size(int n, int* width, int* height) {
+    static const int wide[4] = { 100, 150, 230, 300 };
+    *width = n % 8 == 7 ? wide[n / 8 % 4] : 5 + n % 6;
+    *height = n % 8 == 7 ? 30 + n % 50 : 4 + n % 5;
+}
+
+// The game of the same board as another one, made by random_game().
+void same_game(GameState* state, const GameState* game, const char* board) {
+    init_game_state(state, game->width, game->height);
+    load_board(state, board);
+    state->pos_x = game->pos_x;
+    state->pos_y = game->pos_y;
+    state->level_gems = game->level_gems;
+}
+
+// Random board n, of the size random_size() gives it, loaded into state, whose engine
+// is already set. Returns the board, for same_game(), which the caller frees.
+char* random_game(GameState* state, int n, unsigned int* seed) {
+    int width, height;
+    random_size(n, &width, &height);
+    char* board = allocate((size_t)width * height, 1);
+    GameState game = { .width = width, .height = height };
+    random_board(board, width, height, seed, &game.pos_x, &game.pos_y);
+    for (size_t k = 0; k < (size_t)width * height; ++k) game.level_gems += is_gem(board[k]);
+    same_game(state, &game, board);
+    return board;
+}
+
+// Runs the same random boards and keys through the scan and another engine.
+int compare_engines(int engine) {
+    unsigned int seed = 2463534242u;
+    for (int n = 0; n < 2000; ++n) {
+        GameState scan = {}, other = { .engine = engine };
+        char* board = random_game(&scan, n, &seed);
+        same_game(&other, &scan, board);
+
+        for (int t = 0; t < 8; ++t) {
+            scan.key = other.key = (seed >> t) % 5;
+            update(&scan);
+            update(&other);
+            copy_board(&other, other.front, board);
+            if (compare_screen(&scan, board) != 0 || scan.dead != other.dead) {
+                printf("\e[38;2;250;10;10mEngine %d differs from the scan on board %d after tick %d\n", engine, n, t);
+                return 1;
+            }
+            swap_screens(&scan);
+            swap_screens(&other);
+        }
+        free(board);
+        free_game_state(&scan);
+        free_game_state(&other);
+    }
+    return 0;
+}
+
+int test_bitboard_matches_scan() {
+    return compare_engines(ENGINE_BITBOARD);
+}
+
+int test_lut_matches_scan() {
+    uint16_t lut[LUT_SIZE];
+    generate_physics_lut(lut);
+    if (memcmp(lut, physics_lut, sizeof(lut)) != 0) {
+        printf("\e[38;2;250;10;10mphysics_lut is out of date, regenerate it with --gen-lut\n");
+        return 1;
+    }
+    return compare_engines(ENGINE_LUT);
+}
+
+int test_entities_match_scan() {
+    if (compare_engines(ENGINE_ENTITIES) != 0) return 1;
+
+    // the list has every object of the board once, in scan order
+    unsigned int seed = 3141592653u;
+    for (int n = 0; n < 200; ++n) {
+        GameState state = { .engine = ENGINE_ENTITIES };
+        char* board = random_game(&state, n, &seed);
+        int width = state.width;
+        for (int t = 0; t < 6; ++t) {
+            state.key = (seed >> t) % 5;
+            update(&state);
+            int objects = 0;
+            for (size_t k = 0; k < board_size(&state); ++k) objects += is_object(get_cell(&state, k % width, k / width));
+            const EntityArrays* live = &state.entities.live;
+            int ok = objects == state.entities.count;
+            for (int k = 0; k < state.entities.count && ok; ++k) {
+                char c = get_cell(&state, live->x[k], live->y[k]);
+                ok = is_object(c) && live->gem[k] == (c == '$' || c == 'S' || c == 'p')
+                    && (k == 0 || scan_key(&state, live->x[k - 1], live->y[k - 1]) > scan_key(&state, live->x[k], live->y[k]));
+            }
+            if (!ok) {
+                printf("\e[38;2;250;10;10mEntity list does not match random board %d after tick %d\n", n, t);
+                return 1;
+            }
+            swap_screens(&state);
+        }
+        free(board);
+        free_game_state(&state);
+    }
+    return 0;
+}
+
+int test_two_buffer_reads_previous_board() {
+    char level[4][5] = {
+        {'X', 'X', 'X', 'X', '\n'},
+        {'X', 'o', '.', 'X', '\n'},
+        {'X', 'o', '.', 'X', '\n'},
+        {'X', 'X', 'X', 'X', '\n'}
+    };
+
+    // the top rock still sees a falling rock below it, it only lands a tick later
+    char expected1[4][5] = {
+        {'X', 'X', 'X', 'X', '\n'},
+        {'X', 'o', '.', 'X', '\n'},
+        {'X', 'O', '.', 'X', '\n'},
+        {'X', 'X', 'X', 'X', '\n'}
+    };
+
+    char expected2[4][5] = {
+        {'X', 'X', 'X', 'X', '\n'},
+        {'X', 'O', '.', 'X', '\n'},
+        {'X', 'O', '.', 'X', '\n'},
+        {'X', 'X', 'X', 'X', '\n'}
+    };
+
+    GameState state = {
+        .engine = ENGINE_TWO_BUFFER,
+    };
+    init_game_state(&state, 5, 4);
+    load_board(&state, &level[0][0]);
+
+    update(&state);
+    if (compare_screen(&state, expected1) != 0) {
+        printf("\e[38;2;250;10;10mState after update() is not equal to expected1\n");
+        return 1;
+    }
+    swap_screens(&state);
+
+    update(&state);
+    if (compare_screen(&state, expected2) != 0) {
+        printf("\e[38;2;250;10;10mState after update() is not equal to expected2\n");
+        return 1;
+    }
+    free_game_state(&state);
+
+    // rows can be proposed in any order
+    unsigned int seed = 88172645u;
+    for (int n = 0; n < 1000; ++n) {
+        state = (GameState){ .engine = ENGINE_TWO_BUFFER };
+        char* board = random_game(&state, n, &seed);
+        int width = state.width, height = state.height;
+        size_t size = board_size(&state);
+        CellChange* forward = allocate(size, sizeof(CellChange));
+        CellChange* backward = allocate(size, sizeof(CellChange));
+        int forward_count = 0, backward_count = 0;
+        for (int j = 1; j < height; ++j) propose_cells(&state, j, 0, width, forward, &forward_count);
+        for (int j = height - 1; j >= 1; --j) propose_cells(&state, j, 0, width, backward, &backward_count);
+        char* next_forward = board;
+        char* next_backward = allocate(size, 1);
+        memcpy(next_backward, board, size);
+        for (int k = 0; k < forward_count; ++k) next_forward[forward[k].y * width + forward[k].x] = forward[k].c;
+        for (int k = 0; k < backward_count; ++k) next_backward[backward[k].y * width + backward[k].x] = backward[k].c;
+        if (forward_count != backward_count || memcmp(next_forward, next_backward, size) != 0) {
+            printf("\e[38;2;250;10;10mRow order changed the next board of random board %d\n", n);
+            return 1;
+        }
+        free(forward);
+        free(backward);
+        free(next_forward);
+        free(next_backward);
+        free_game_state(&state);
+    }
+
+    return 0;
+}
+
+// A board loaded again before every tick starts with everything awake. Keeping
+// the chunks that settled asleep must not change what any engine does.
+int test_sleeping_chunks_match_awake_board() {
+    static const int engines[5] = { ENGINE_SCAN, ENGINE_LUT, ENGINE_BITBOARD, ENGINE_TWO_BUFFER, ENGINE_ENTITIES };
+    unsigned int seed = 1597334677u;
+    for (int n = 0; n < 64; ++n) {
+        int width = 40 + n * 5, height = 20 + n % 7 * 10, pos_x, pos_y;
+        int engine = engines[n % 5];
+        GameState sleeping = { .engine = engine };
+        init_game_state(&sleeping, width, height);
+        char* board = allocate(board_size(&sleeping), 1);
+        random_board(board, width, height, &seed, &pos_x, &pos_y);
+        load_board(&sleeping, board);
+        sleeping.pos_x = pos_x;
+        sleeping.pos_y = pos_y;
+
+        for (int t = 0; t < 60; ++t) {
+            GameState awake = { .engine = engine, .pos_x = sleeping.pos_x, .pos_y = sleeping.pos_y };
+            init_game_state(&awake, width, height);
+            load_board(&awake, board);
+            awake.key = sleeping.key = (seed >> (t % 32)) % 5;
+            update(&awake);
+            update(&sleeping);
+            copy_board(&awake, awake.front, board);
+            if (compare_screen(&sleeping, board) != 0 || sleeping.dead != awake.dead) {
+                printf("\e[38;2;250;10;10mEngine %d differs on board %d after tick %d\n", engine, n, t);
+                return 1;
+            }
+            swap_screens(&sleeping);
+            free_game_state(&awake);
+            if (sleeping.dead) break;
+        }
+        free(board);
+        free_game_state(&sleeping);
+    }
+    return 0;
+}
+
+int test_packed_chunk_round_trip() {
+    // every tile in both nibbles
+    char tiles[CHUNK_SIZE * CHUNK_SIZE], unpacked[CHUNK_SIZE * CHUNK_SIZE];
+    for (int i = 0; i < CHUNK_SIZE * CHUNK_SIZE; ++i) tiles[i] = packed_tiles[(i + i / 24) % 12];
+    uint8_t packed[PACKED_CHUNK_SIZE];
+    pack_chunk(tiles, packed);
+    if (unpack_chunk(packed, unpacked) != 0 || memcmp(tiles, unpacked, sizeof(tiles)) != 0) {
+        printf("\e[38;2;250;10;10mPacked chunk of every tile does not unpack to itself\n");
+        return 1;
+    }
+    for (int i = 0; i < CHUNK_SIZE * CHUNK_SIZE; ++i) {
+        Chunk chunk = { .cells = packed };
+        GameState state = { .width = CHUNK_SIZE, .height = CHUNK_SIZE, .chunks_x = 1, .chunks = &chunk };
+        int x = i % CHUNK_SIZE, y = i / CHUNK_SIZE;
+        if (get_cell(&state, x, y) != tiles[chunk_cell(x, y)]) {
+            printf("\e[38;2;250;10;10mCell (%d, %d) of a packed chunk is not '%c'\n", x, y, tiles[chunk_cell(x, y)]);
+            return 1;
+        }
+    }
+    packed[100] ^= 0x10;
+    if (unpack_chunk(packed, unpacked) == 0) {
+        printf("\e[38;2;250;10;10mDamaged packed chunk was unpacked\n");
+        return 1;
+    }
+    packed[100] = 0xcc; // codes past the last tile
+    put_le(&packed[PACKED_CELLS], level_checksum(CHECKSUM_SEED, packed, PACKED_CELLS), 8);
+    if (unpack_chunk(packed, unpacked) == 0) {
+        printf("\e[38;2;250;10;10mPacked chunk with an unknown tile was unpacked\n");
+        return 1;
+    }
+
+    // either board of a running game packs into a level that loads into that board
+    unsigned int seed = 2654435761u;
+    for (int n = 0; n < 200; ++n) {
+        GameState state = {};
+        char* board = random_game(&state, n, &seed);
+        char* copy = allocate(board_size(&state), 1);
+        for (int t = 0; t < n % 5; ++t) {
+            update(&state);
+            swap_screens(&state);
+        }
+        copy_board(&state, state.front ^ 1, board);
+        uint8_t* level;
+        size_t size = write_binary_level(&state, state.front ^ 1, &level);
+        GameState restored = {};
+        LevelInfo info;
+        if (load_binary_level(&restored, level, size, 0, &info) != 0) {
+            printf("\e[38;2;250;10;10mCould not load the packed board %d: %s\n", n, info.error);
+            return 1;
+        }
+        copy_board(&restored, restored.front, copy);
+        if (memcmp(board, copy, board_size(&state)) != 0 || restored.board_hash != state.board_hash) {
+            printf("\e[38;2;250;10;10mPacked board differs from random board %d\n", n);
+            return 1;
+        }
+        free(level);
+        free(board);
+        free(copy);
+        free_game_state(&state);
+        free_game_state(&restored);
+    }
+    return 0;
+}
+
+// A pass cut into slices of a few cells has to end where the whole pass does.
+int test_sliced_ticks_match_whole_ticks() {
+    unsigned int seed = 1013904223u;
+    long slices = 0;
+    for (int n = 0; n < 400; ++n) {
+        int engine = n % 2 ? ENGINE_LUT : ENGINE_SCAN;
+        GameState whole = { .engine = engine }, sliced = { .engine = engine };
+        char* board = random_game(&whole, n, &seed);
+        same_game(&sliced, &whole, board);
+
+        long budget = 1 + n % 7;
+        for (int t = 0; t < 8; ++t) {
+            whole.key = sliced.key = (seed >> t) % 5;
+            update(&whole);
+            swap_screens(&whole);
+            int done;
+            do {
+                done = update_slice(&sliced, budget, 0);
+                swap_screens(&sliced);
+                ++slices;
+            } while (!done);
+            copy_board(&sliced, sliced.front ^ 1, board);
+            char* expected = allocate(board_size(&whole), 1);
+            copy_board(&whole, whole.front ^ 1, expected);
+            int differs = memcmp(board, expected, board_size(&whole)) != 0 || whole.dead != sliced.dead || whole.count != sliced.count;
+            free(expected);
+            if (differs) {
+                printf("\e[38;2;250;10;10mSliced tick differs on board %d after tick %d\n", n, t);
+                return 1;
+            }
+        }
+        free(board);
+        free_game_state(&whole);
+        free_game_state(&sliced);
+    }
+    if (slices < 2 * 400 * 8) {
+        printf("\e[38;2;250;10;10mOnly %ld slices for %d ticks\n", slices, 400 * 8);
+        return 1;
+    }
+    return 0;
+}
+
+// A settled board is the one the same number of ticks without a key reach,
+// and the next tick does not change it.
+int test_settle_matches_idle_ticks() {
+    static const int engines[4] = { ENGINE_SCAN, ENGINE_BITBOARD, ENGINE_TWO_BUFFER, ENGINE_ENTITIES };
+    unsigned int seed = 2891336453u;
+    int settled = 0, crushed = 0;
+    for (int n = 0; n < 400; ++n) {
+        int engine = engines[n % 4];
+        GameState settling = { .engine = engine }, ticking = { .engine = engine };
+        char* board = random_game(&settling, n, &seed);
+        same_game(&ticking, &settling, board);
+        char* expected = allocate(board_size(&settling), 1);
+
+        long ticks = settle_level(&settling, 100000);
+        if (ticks < 0) {
+            ++crushed;
+            memcpy(expected, board, board_size(&settling));
+        } else {
+            ++settled;
+            for (long t = 0; t < ticks; ++t) {
+                update(&ticking);
+                swap_screens(&ticking);
+            }
+            copy_board(&ticking, ticking.front ^ 1, expected);
+        }
+        if (compare_screen(&settling, expected) != 0 || settling.count != 0 || settling.dead) {
+            printf("\e[38;2;250;10;10mSettled board %d is not the board after %ld ticks\n", n, ticks);
+            return 1;
+        }
+        update(&settling);
+        if (ticks >= 0 && settling.damage_count != 0) {
+            printf("\e[38;2;250;10;10mSettled board %d still moves\n", n);
+            return 1;
+        }
+        free(board);
+        free(expected);
+        free_game_state(&settling);
+        free_game_state(&ticking);
+    }
+    if (!settled || !crushed) {
+        printf("\e[38;2;250;10;10mOnly %d boards settled and %d would crush the player\n", settled, crushed);
+        return 1;
+    }
+    return 0;
+}
+
+// The hash kept up by set_cell() is the hash of the whole board, for every engine.
+int test_incremental_hash() {
+    static const int engines[5] = { ENGINE_SCAN, ENGINE_LUT, ENGINE_BITBOARD, ENGINE_TWO_BUFFER, ENGINE_ENTITIES };
+    unsigned int seed = 362436069u;
+    for (int n = 0; n < 500; ++n) {
+        GameState state = { .engine = engines[n % 5] };
+        char* board = random_game(&state, n, &seed);
+        for (int t = 0; t < 8; ++t) {
+            state.key = (seed >> t) % 5;
+            update(&state);
+            if (state.board_hash != hash_board(&state, state.front)) {
+                printf("\e[38;2;250;10;10mHash of board %d is off after tick %d\n", n, t);
+                return 1;
+            }
+            swap_screens(&state);
+        }
+        // the same board loaded again has the same hash, a changed one another
+        uint64_t hash = state_hash(&state);
+        copy_board(&state, state.front ^ 1, board);
+        load_board(&state, board);
+        if (state_hash(&state) != hash) {
+            printf("\e[38;2;250;10;10mReloaded board %d has another hash\n", n);
+            return 1;
+        }
+        set_cell(&state, 1, 1, get_cell(&state, 1, 1) == 'X' ? ' ' : 'X');
+        ++state.gems_collected;
+        if (state_hash(&state) == hash) {
+            printf("\e[38;2;250;10;10mChanged board %d kept its hash\n", n);
+            return 1;
+        }
+        free(board);
+        free_game_state(&state);
+    }
+    return 0;
+}
+
+int test_parse_level() {
+    // random levels are all fine, and the parse finds their player and gems
+    unsigned int seed = 88675123u;
+    for (int n = 0; n < 200; ++n) {
+        GameState state = {};
+        char* board = random_game(&state, n, &seed);
+        LevelInfo info;
+        if (parse_level(board, board_size(&state), &info) != 0) {
+            printf("\e[38;2;250;10;10mRandom level %d does not parse: %ld:%ld: %s\n", n, info.line, info.column, info.error);
+            return 1;
+        }
+        if (info.width != state.width || info.height != state.height || info.pos_x != state.pos_x
+                || info.pos_y != state.pos_y || info.gems != state.level_gems) {
+            printf("\e[38;2;250;10;10mParse of random level %d found the wrong size, player or gems\n", n);
+            return 1;
+        }
+        free(board);
+        free_game_state(&state);
+    }
+
+    // broken levels, and where the parse has to point at
+    static const struct {
+        const char* level;
+        long line;
+        long column;
+    } broken[] = {
+        { "XXXX\nX@ X\nXXX\n", 3, 4 }, // short row
+        { "XXXX\nX@  X\nXXXX\n", 2, 5 }, // long row
+        { "XXXX\nX@?X\nXXXX\n", 2, 3 }, // unknown tile
+        { "XXXX\nX@ X\nX.?X\nXXXX\n", 3, 3 },
+        { "XXXX\r\nX@ X\r\nXXXX\r\n", 1, 5 },
+        { "XXXX\nX@@X\nXXXX\n", 2, 3 }, // second player
+        { "XXXX\nX@ X\nXX X\n", 3, 3 }, // hole in the bottom wall
+        { "XX X\nX@ X\nXXXX\n", 1, 3 },
+        { "XXXX\n @ X\nXXXX\n", 2, 1 },
+        { "XXXX\nX@ E\nXXXX\n", 2, 4 },
+        { "XXXX\nX@ X\nXXXX", 3, 5 }, // no newline at the end
+        { "X\nX\nX\n", 1, 2 }, // too narrow
+        { "XXXX\nX  X\nXXXX\n", 0, 0 }, // no player
+        { "XXXX\nX@ X\n", 0, 0 }, // too few rows
+        { "", 0, 0 },
+    };
+    for (size_t k = 0; k < sizeof(broken) / sizeof(broken[0]); ++k) {
+        LevelInfo info;
+        if (parse_level(broken[k].level, strlen(broken[k].level), &info) == 0) {
+            printf("\e[38;2;250;10;10mBroken level %zu was accepted\n", k);
+            return 1;
+        }
+        if (info.line != broken[k].line || (info.line && info.column != broken[k].column)) {
+            printf("\e[38;2;250;10;10mBroken level %zu reported at %ld:%ld: %s\n", k, info.line, info.column, info.error);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Both boards and everything load_board() sets up have to be the same.
+int compare_loaded_levels(const GameState* a, const GameState* b) {
+    if (a->width != b->width || a->height != b->height || a->pos_x != b->pos_x || a->pos_y != b->pos_y
+            || a->level_gems != b->level_gems || a->board_hash != b->board_hash) return 1;
+    for (size_t k = 0; k < (size_t)a->chunks_x * a->chunks_y; ++k) {
+        const Chunk* ca = &a->chunks[k];
+        const Chunk* cb = &b->chunks[k];
+        if (!ca->data != !cb->data || ca->fill != cb->fill || ca->gems != cb->gems) return 1;
+        if (ca->data && memcmp(ca->data->tiles, cb->data->tiles, sizeof(ca->data->tiles)) != 0) return 1;
+    }
+    return 0;
+}
+
+int test_binary_level_round_trip() {
+    // random levels, and a wide one that is mostly uniform, with runs longer than 127 chunks
+    unsigned int seed = 19650218u;
+    for (int n = 0; n <= 100; ++n) {
+        GameState text = {}, binary = {};
+        LevelInfo info;
+        char* board;
+        if (n < 100) {
+            board = random_game(&text, n, &seed);
+        } else {
+            int width = 9001, height = 64;
+            board = allocate((size_t)width * height, 1);
+            for (int k = 0; k < width * height; ++k) board[k] = k % width == width - 1 ? '\n' : 'X';
+            board[width + 1] = '@';
+            if (load_text_level(&text, board, (size_t)width * height, &info) != 0) {
+                printf("\e[38;2;250;10;10mLevel of walls does not load: %s\n", info.error);
+                return 1;
+            }
+        }
+        uint8_t* level;
+        size_t size = write_binary_level(&text, text.front, &level);
+        if (load_binary_level(&binary, level, size, 0, &info) != 0 || compare_loaded_levels(&text, &binary) != 0) {
+            printf("\e[38;2;250;10;10mBinary level %d loads into another game: %s\n", n, info.error);
+            return 1;
+        }
+        if (n == 100 && size > 4096) {
+            printf("\e[38;2;250;10;10mBinary level of walls takes %zu bytes\n", size);
+            return 1;
+        }
+        free_game_state(&binary);
+
+        // damaged and cut off files are refused
+        GameState broken = {};
+        level[LEVEL_HEADER_SIZE + (seed % (size - LEVEL_HEADER_SIZE))] ^= 1 << (n % 8);
+        if (load_binary_level(&broken, level, size, 0, &info) == 0) {
+            printf("\e[38;2;250;10;10mDamaged binary level %d was loaded\n", n);
+            return 1;
+        }
+        free_game_state(&broken);
+        broken = (GameState){};
+        if (load_binary_level(&broken, level, size - 1, 0, &info) == 0) {
+            printf("\e[38;2;250;10;10mCut off binary level %d was loaded\n", n);
+            return 1;
+        }
+        free_game_state(&broken);
+        free(level);
+        free(board);
+        free_game_state(&text);
+    }
+    return 0;
+}
+
+// Every level of a pack, loaded on the prefetch thread, is the level that went in.
+int test_pack_levels() {
+    enum { LEVELS = 12 };
+    GameState levels[LEVELS] = {};
+    const char* names[LEVELS];
+    unsigned int seed = 1812433253u;
+    for (int i = 0; i < LEVELS; ++i) {
+        int width, height, pos_x, pos_y;
+        random_size(i * 7, &width, &height);
+        char* board = allocate((size_t)width * height, 1);
+        random_board(board, width, height, &seed, &pos_x, &pos_y);
+        LevelInfo info;
+        load_text_level(&levels[i], board, (size_t)width * height, &info);
+        names[i] = i % 2 ? "levels/odd.txt" : "even.txt";
+        free(board);
+    }
+    uint8_t* data;
+    size_t size = write_pack(levels, names, LEVELS, &data);
+    Pack pack;
+    LevelInfo info;
+    if (read_pack(&pack, data, size, &info) != 0 || pack.count != LEVELS) {
+        printf("\e[38;2;250;10;10mCould not read a pack back: %s\n", info.error);
         return 1;
     }
-    memcpy(state.old_screen, state.screen, sizeof(state.screen));
-    state.key = 0;
+    for (int i = 0; i < LEVELS; ++i) {
+        if (strcmp(pack.entries[i].name, i % 2 ? "odd.txt" : "even.txt") != 0 || pack.entries[i].gems != (uint32_t)levels[i].level_gems) {
+            printf("\e[38;2;250;10;10mIndex entry %d of the pack is wrong\n", i);
+            return 1;
+        }
+        Prefetch prefetch;
+        start_prefetch(&prefetch, &pack, i, ENGINE_SCAN, 0);
+        if (finish_prefetch(&prefetch) != 0 || compare_loaded_levels(&levels[i], &prefetch.state) != 0) {
+            printf("\e[38;2;250;10;10mLevel %d of the pack is another level: %s\n", i, prefetch.info.error);
+            return 1;
+        }
+        free_game_state(&prefetch.state);
+    }
+    free(pack.entries);
 
-    update(&state);
-    ret = memcmp(state.screen, expected2, sizeof(expected2));
-    if (ret != 0) {
-        printf("\e[38;2;250;10;10mState after update() is not equal to expected2\n");
+    // a damaged index is refused, and so is a level moved to another entry
+    data[PACK_HEADER_SIZE + 40] ^= 4;
+    if (read_pack(&pack, data, size, &info) == 0) {
+        printf("\e[38;2;250;10;10mDamaged pack index was read\n");
         return 1;
     }
-    memcpy(state.old_screen, state.screen, sizeof(state.screen));
-
-    update(&state);
-    ret = memcmp(state.screen, expected3, sizeof(expected3));
-    if (ret != 0) {
-        printf("\e[38;2;250;10;10mState after update() is not equal to expected3\n");
+    free(pack.entries);
+    data[PACK_HEADER_SIZE + 40] ^= 4;
+    read_pack(&pack, data, size, &info);
+    pack.entries[1].offset = pack.entries[0].offset;
+    pack.entries[1].size = pack.entries[0].size;
+    GameState state = {};
+    if (load_pack_level(&state, &pack, 1, &info) == 0) {
+        printf("\e[38;2;250;10;10mLevel in the wrong entry of a pack was loaded\n");
         return 1;
     }
-    memcpy(state.old_screen, state.screen, sizeof(state.screen));
-
+    free_game_state(&state);
+    free(pack.entries);
+    free(data);
+    for (int i = 0; i < LEVELS; ++i) free_game_state(&levels[i]);
     return 0;
 }
 
-int test_rock_rolls() {
-    GameState state = {
-        .old_screen = {
-                {'X', 'X', 'X', 'X', '\n'},
-                {'X', ' ', 'O', 'X', '\n'},
-                {'X', ' ', 'O', 'X', '\n'},
-                {'X', 'X', 'X', 'X', '\n'}
-            },
-        .key = 0,
-        .pos_x = 0,
-        .pos_y = 0,
-    };
+// Playing the keys of a recorded game on the same level ends in the same state, the
+// replay of a long game with few keys is small, and broken replays are refused.
+int test_replay_matches_recording() {
+    static const int engines[5] = { ENGINE_SCAN, ENGINE_LUT, ENGINE_BITBOARD, ENGINE_TWO_BUFFER, ENGINE_ENTITIES };
+    unsigned int seed = 1597334677u;
+    for (int n = 0; n < 100; ++n) {
+        GameState played = { .engine = engines[n % 5] }, replayed = { .engine = engines[n % 5] };
+        char* board = random_game(&played, n, &seed);
+        same_game(&replayed, &played, board);
+        size_t size = board_size(&played);
+        LevelInfo info;
+        Recording recording;
+        start_recording(&recording, &played, 100000, 0);
+        long ticks = 2000, keys = 0;
+        for (long t = 0; t < ticks && !played.dead && !played.won; ++t) {
+            seed = seed * 1103515245u + 12345u;
+            played.key = (seed >> 16) % 64 < 4 ? 1 + (seed >> 16) % 4 : 0; // a key now and then
+            keys += played.key != 0;
+            record_key(&recording, &played, played.key);
+            update(&played);
+            swap_screens(&played);
+        }
+        uint8_t* data;
+        size_t replay_size = write_replay(&recording, &played, &data);
+        free_recording(&recording);
+        if (recording.header.keys_size > 4 + 4 * (size_t)keys + 2 * recording.header.keyframes) {
+            printf("\e[38;2;250;10;10mReplay %d of %ld keys takes %llu bytes\n", n, keys,
+                (unsigned long long)recording.header.keys_size);
+            return 1;
+        }
 
-    char expected1[4][5] = {
-        {'X', 'X', 'X', 'X', '\n'},
-        {'X', ' ', 'o', 'X', '\n'},
-        {'X', ' ', 'O', 'X', '\n'},
-        {'X', 'X', 'X', 'X', '\n'}
-    };
+        Replay replay;
+        if (read_replay(&replay, data, replay_size, &info) != 0 || replay.header.start_hash != state_hash(&replayed)) {
+            printf("\e[38;2;250;10;10mReplay %d does not load: %s\n", n, info.error);
+            return 1;
+        }
+        int key;
+        while ((key = replay_key(&replay)) >= 0) {
+            replayed.key = key;
+            update(&replayed);
+            swap_screens(&replayed);
+        }
+        char* expected = allocate(size, 1);
+        copy_board(&played, played.front ^ 1, expected);
+        copy_board(&replayed, replayed.front ^ 1, board);
+        if (memcmp(board, expected, size) != 0 || replayed.count != played.count
+                || state_hash(&replayed) != replay.header.end_hash) {
+            printf("\e[38;2;250;10;10mReplay %d does not end where it was recorded\n", n);
+            return 1;
+        }
 
-    char expected2[4][5] = {
-        {'X', 'X', 'X', 'X', '\n'},
-        {'X', 'o', ' ', 'X', '\n'},
-        {'X', ' ', 'O', 'X', '\n'},
-        {'X', 'X', 'X', 'X', '\n'}
-    };
+        // damaged and cut off replays are refused, the keyframes are checked when they are loaded
+        free(replay.keyframes);
+        size_t damaged = seed % (replay_size - replay.header.frames_size);
+        data[damaged] ^= 1 << (n % 8);
+        if (read_replay(&replay, data, replay_size, &info) == 0) {
+            printf("\e[38;2;250;10;10mDamaged replay %d was read\n", n);
+            return 1;
+        }
+        data[damaged] ^= 1 << (n % 8);
+        if (read_replay(&replay, data, replay_size - 1, &info) == 0) {
+            printf("\e[38;2;250;10;10mCut off replay %d was read\n", n);
+            return 1;
+        }
+        free(expected);
+        free(data);
+        free(board);
+        free_game_state(&played);
+        free_game_state(&replayed);
+    }
+    return 0;
+}
 
-    char expected3[4][5] = {
-        {'X', 'X', 'X', 'X', '\n'},
-        {'X', ' ', ' ', 'X', '\n'},
-        {'X', 'o', 'O', 'X', '\n'},
-        {'X', 'X', 'X', 'X', '\n'}
-    };
+// Seeking a replay, forward and back, gets to the game that was recorded at that tick
+// without playing more than the ticks from a keyframe, and the replay goes on from there.
+int test_seek_matches_replay() {
+    static const int engines[5] = { ENGINE_SCAN, ENGINE_LUT, ENGINE_BITBOARD, ENGINE_TWO_BUFFER, ENGINE_ENTITIES };
+    unsigned int seed = 2718281829u;
+    for (int n = 0; n < 20; ++n) {
+        GameState played = { .engine = engines[n % 5] }, replayed = { .engine = engines[n % 5] };
+        char* board = random_game(&played, n, &seed);
+        same_game(&replayed, &played, board);
+        LevelInfo info;
+        // a level that settled first goes on for long enough to have a few keyframes
+        if (settle_level(&played, 100000) < 0) {
+            free(board);
+            free_game_state(&played);
+            free_game_state(&replayed);
+            continue;
+        }
+        settle_level(&replayed, 100000);
+        Recording recording;
+        start_recording(&recording, &played, 100000, 100000);
+        long ticks = 5000;
+        uint64_t* hashes = allocate(ticks + 1, sizeof(uint64_t));
+        long t = 0;
+        for (; t < ticks && !played.dead && !played.won; ++t) {
+            hashes[t] = state_hash(&played);
+            seed = seed * 1103515245u + 12345u;
+            played.key = (seed >> 16) % 256 < 2 ? 1 + (seed >> 16) % 4 : 0;
+            record_key(&recording, &played, played.key);
+            update(&played);
+            swap_screens(&played);
+        }
+        hashes[t] = state_hash(&played);
+        uint8_t* data;
+        size_t replay_size = write_replay(&recording, &played, &data);
+        free_recording(&recording);
 
-    char expected4[4][5] = {
-        {'X', 'X', 'X', 'X', '\n'},
-        {'X', ' ', ' ', 'X', '\n'},
-        {'X', 'O', 'O', 'X', '\n'},
-        {'X', 'X', 'X', 'X', '\n'}
-    };
+        Replay replay;
+        if (read_replay(&replay, data, replay_size, &info) != 0) {
+            printf("\e[38;2;250;10;10mReplay %d does not load: %s\n", n, info.error);
+            return 1;
+        }
+        const long targets[8] = { 3000, 1024, 1025, t, 1023, 0, 1, t / 2 };
+        for (int k = 0; k < 8; ++k) {
+            long target = targets[k] < t ? targets[k] : t;
+            long from = seek_replay(&replayed, &replay, target, &info);
+            if (from < 0 || from > target || target - from >= REPLAY_KEYFRAME_TICKS
+                    || replayed.count != target || state_hash(&replayed) != hashes[target]) {
+                printf("\e[38;2;250;10;10mReplay %d seeked to %ld from %ld is not the recorded game\n", n, target, from);
+                return 1;
+            }
+        }
+        int key;
+        while ((key = replay_key(&replay)) >= 0) {
+            replayed.key = key;
+            update(&replayed);
+            swap_screens(&replayed);
+        }
+        if (replayed.count != t || state_hash(&replayed) != replay.header.end_hash) {
+            printf("\e[38;2;250;10;10mReplay %d does not end where it was recorded after seeking\n", n);
+            return 1;
+        }
 
-    update(&state);
-    int ret = memcmp(state.screen, expected1, sizeof(expected1));
-    if (ret != 0) {
-        printf("\e[38;2;250;10;10mState after update() is not equal to expected1\n");
-        // memset(state.old_screen, '?', sizeof(state.old_screen));
-        // render(&state);
-        return 1;
+        // a damaged keyframe is refused when it is seeked to
+        const Keyframe* first = &replay.keyframes[0];
+        data[first->frame_offset + seed % first->frame_size] ^= 1 << (n % 8);
+        if (seek_replay(&replayed, &replay, 0, &info) >= 0) {
+            printf("\e[38;2;250;10;10mReplay %d seeked to a damaged keyframe\n", n);
+            return 1;
+        }
+        free(replay.keyframes);
+        free(hashes);
+        free(data);
+        free(board);
+        free_game_state(&played);
+        free_game_state(&replayed);
     }
-    memcpy(state.old_screen, state.screen, sizeof(state.screen));
+    return 0;
+}
 
-    update(&state);
-    ret = memcmp(state.screen, expected2, sizeof(expected2));
-    if (ret != 0) {
-        printf("\e[38;2;250;10;10mState after update() is not equal to expected2\n");
-        memset(state.old_screen, '?', sizeof(state.old_screen));
+// The cells that skip_render() leaves to the next render() are the cells of the view
+// written by the ticks in between, whatever was written outside the view is dropped,
+// and render() draws them and forgets them.
+int test_skip_render_keeps_view_damage() {
+    static const int engines[5] = { ENGINE_SCAN, ENGINE_LUT, ENGINE_BITBOARD, ENGINE_TWO_BUFFER, ENGINE_ENTITIES };
+    unsigned int seed = 3141592653u;
+    long outside = 0;
+    for (int n = 0; n < 100; ++n) {
+        GameState state = { .engine = engines[n % 5] };
+        char* board = random_game(&state, n, &seed);
+        // a view in the middle of the board, like init_view() on a small terminal
+        state.view_width = (state.width - 1) / 2;
+        state.view_height = state.height / 2;
+        state.view_x = (state.width - 1) / 4;
+        state.view_y = state.height / 4;
+        size_t words = ((size_t)state.view_width * state.view_height + 63) / 64;
+        state.skipped = allocate(words, sizeof(uint64_t));
+        uint64_t* expected = allocate(words, sizeof(uint64_t));
+        for (int t = 0; t < 1 + n % 8; ++t) {
+            seed = seed * 1103515245u + 12345u;
+            state.key = (seed >> 16) % 5;
+            update(&state);
+            skip_render(&state);
+            for (int k = 0; k < state.damage_count; ++k) {
+                int x = state.damage[k] % state.width, y = state.damage[k] / state.width;
+                if (!in_view(&state, x, y)) {
+                    ++outside;
+                    continue;
+                }
+                size_t i = (size_t)(y - state.view_y) * state.view_width + (x - state.view_x);
+                expected[i >> 6] |= 1ull << (i & 63);
+            }
+            swap_screens(&state);
+        }
+        if (memcmp(state.skipped, expected, words * sizeof(uint64_t)) != 0) {
+            printf("\e[38;2;250;10;10mSkipped cells of game %d are not the damage in the view\n", n);
+            return 1;
+        }
+
+        // render() to nowhere, the test only looks at what it leaves behind
+        fflush(stdout);
+        int out = dup(STDOUT_FILENO), null = open("/dev/null", O_WRONLY);
+        dup2(null, STDOUT_FILENO);
         render(&state);
+        fflush(stdout);
+        dup2(out, STDOUT_FILENO);
+        close(null);
+        close(out);
+        for (size_t w = 0; w < words; ++w) {
+            if (state.skipped[w] != 0) {
+                printf("\e[38;2;250;10;10mRender of game %d left skipped cells\n", n);
+                return 1;
+            }
+        }
+        free(expected);
+        free(board);
+        free_game_state(&state);
+    }
+    if (outside == 0) {
+        printf("\e[38;2;250;10;10mNo tick wrote a cell outside the view\n");
         return 1;
     }
-    memcpy(state.old_screen, state.screen, sizeof(state.screen));
+    return 0;
+}
 
-    update(&state);
-    ret = memcmp(state.screen, expected3, sizeof(expected3));
-    if (ret != 0) {
-        printf("\e[38;2;250;10;10mState after update() is not equal to expected3\n");
+// Rewinding ticks, sliced ones too, takes the game back to exactly where it was, and
+// it plays on from there as it did the first time. A tick of nothing takes 3 bytes.
+int test_rewind_matches_earlier_ticks() {
+    static const int engines[5] = { ENGINE_SCAN, ENGINE_LUT, ENGINE_BITBOARD, ENGINE_TWO_BUFFER, ENGINE_ENTITIES };
+    unsigned int seed = 1414213562u;
+    for (int n = 0; n < 50; ++n) {
+        GameState state = { .engine = engines[n % 5] };
+        char* board = random_game(&state, n, &seed);
+        size_t size = board_size(&state);
+        LevelInfo info;
+        Rewind rewind;
+        start_rewind(&rewind);
+        long ticks = 300, budget = n % 2 ? 7 : 0; // only the scan engines stop in the middle of a pass
+        uint64_t* hashes = allocate(ticks + 1, sizeof(uint64_t));
+        int* keys = allocate(ticks, sizeof(int));
+        char* middle = allocate(size, 1);
+        long t = 0;
+        for (; t < ticks && !state.dead && !state.won; ++t) {
+            if (t == ticks / 2) copy_board(&state, state.front ^ 1, middle);
+            hashes[t] = state_hash(&state);
+            seed = seed * 1103515245u + 12345u;
+            keys[t] = state.key = (seed >> 16) % 8 < 4 ? 1 + (seed >> 16) % 4 : 0;
+            begin_rewind_tick(&rewind, &state);
+            int done;
+            do {
+                done = update_slice(&state, budget, 0);
+                add_rewind_cells(&rewind, &state);
+                swap_screens(&state);
+            } while (!done);
+            end_rewind_tick(&rewind, &state);
+        }
+        hashes[t] = state_hash(&state);
+        char* expected = allocate(size, 1);
+        copy_board(&state, state.front ^ 1, expected);
+
+        // back to the middle, and when the game got there, on to where it ended
+        long back = t - ticks / 2;
+        for (long k = 1; k <= back; ++k) {
+            if (!rewind_tick(&state, &rewind)) {
+                printf("\e[38;2;250;10;10mRewind %d ran out after %ld of %ld ticks\n", n, k - 1, back);
+                return 1;
+            }
+            swap_screens(&state);
+            if (state_hash(&state) != hashes[t - k] || state.count != (unsigned int)(t - k)) {
+                printf("\e[38;2;250;10;10mRewind %d of %ld ticks is not tick %ld\n", n, k, t - k);
+                return 1;
+            }
+        }
+        if (back > 0) {
+            copy_board(&state, state.front ^ 1, board);
+            if (memcmp(board, middle, size) != 0) {
+                printf("\e[38;2;250;10;10mRewind %d does not get the board back\n", n);
+                return 1;
+            }
+        }
+        for (long k = t - back; k < t; ++k) {
+            state.key = keys[k];
+            update(&state);
+            swap_screens(&state);
+        }
+        copy_board(&state, state.front ^ 1, board);
+        if (memcmp(board, expected, size) != 0 || state_hash(&state) != hashes[t]) {
+            printf("\e[38;2;250;10;10mGame %d does not play on the same after rewinding\n", n);
+            return 1;
+        }
+
+        // a tick of nothing on a settled board
+        clear_rewind(&rewind);
+        GameState idle = { .engine = engines[n % 5] };
+        load_text_level(&idle, board, size, &info);
+        long settled = settle_level(&idle, 100000);
+        for (int k = 0; k < 100; ++k) {
+            begin_rewind_tick(&rewind, &idle);
+            update(&idle);
+            add_rewind_cells(&rewind, &idle);
+            swap_screens(&idle);
+            end_rewind_tick(&rewind, &idle);
+        }
+        if (settled >= 0 && settled < 100000 && rewind.end - rewind.start != 300) {
+            printf("\e[38;2;250;10;10mRewind %d takes %llu bytes for 100 ticks of nothing\n", n,
+                (unsigned long long)(rewind.end - rewind.start));
+            return 1;
+        }
+        free_rewind(&rewind);
+        free(hashes);
+        free(keys);
+        free(middle);
+        free(expected);
+        free(board);
+        free_game_state(&state);
+        free_game_state(&idle);
+    }
+
+    // the oldest ticks make room for the new ones
+    GameState state = {};
+    int width = 64, height = 48, pos_x, pos_y;
+    char* board = allocate((size_t)width * height, 1);
+    random_board(board, width, height, &seed, &pos_x, &pos_y);
+    LevelInfo info;
+    load_text_level(&state, board, (size_t)width * height, &info);
+    settle_level(&state, 100000);
+    Rewind rewind;
+    start_rewind(&rewind);
+    for (int k = 0; k < REWIND_SIZE; ++k) {
+        begin_rewind_tick(&rewind, &state);
+        update(&state);
+        add_rewind_cells(&rewind, &state);
+        swap_screens(&state);
+        end_rewind_tick(&rewind, &state);
+    }
+    long undone = 0;
+    while (rewind_tick(&state, &rewind)) {
+        swap_screens(&state);
+        ++undone;
+    }
+    if (rewind.end - rewind.start != 0 || undone != REWIND_SIZE / 3) {
+        printf("\e[38;2;250;10;10mRewind keeps %ld of the last ticks\n", undone);
         return 1;
     }
-    memcpy(state.old_screen, state.screen, sizeof(state.screen));
+    free_rewind(&rewind);
+    free(board);
+    free_game_state(&state);
+    return 0;
+}
 
-    update(&state);
-    ret = memcmp(state.screen, expected4, sizeof(expected4));
-    if (ret != 0) {
-        printf("\e[38;2;250;10;10mState after update() is not equal to expected4\n");
+// A game whose level file was edited while it was played goes on like the edited
+// level loaded from scratch, and reloading writes exactly the cells that changed.
+int test_reload_matches_fresh_load() {
+    static const int engines[4] = { ENGINE_SCAN, ENGINE_LUT, ENGINE_BITBOARD, ENGINE_ENTITIES };
+    unsigned int seed = 2654435769u;
+    for (int n = 0; n < 200; ++n) {
+        GameState played = { .engine = engines[n % 4] }, fresh = { .engine = engines[n % 4] }, edited = {};
+        char* board = random_game(&played, n, &seed);
+        int width = played.width, height = played.height;
+        size_t size = board_size(&played);
+        LevelInfo info;
+        for (int t = 0; t < 5; ++t) {
+            played.key = (seed >> t) % 5;
+            update(&played);
+            if (t < 4) swap_screens(&played);
+        }
+
+        // the designer moves the player and changes a few cells
+        copy_board(&played, played.front, board);
+        board[(size_t)played.pos_y * width + played.pos_x] = ' ';
+        for (int k = 0; k < 1 + n % 20; ++k) {
+            seed = seed * 1103515245u + 12345u;
+            int x = 1 + (seed >> 8) % (width - 3), y = 1 + (seed >> 20) % (height - 2);
+            board[(size_t)y * width + x] = " .OoS$XE"[seed % 8];
+        }
+        int pos_x = 1 + seed % (width - 3), pos_y = 1 + (seed >> 12) % (height - 2);
+        board[(size_t)pos_y * width + pos_x] = '@';
+        load_text_level(&fresh, board, size, &info);
+        load_text_level(&edited, board, size, &info);
+        char* before = allocate(size, 1);
+        copy_board(&played, played.front, before);
+        long changed = 0;
+        for (size_t k = 0; k < size; ++k) changed += before[k] != board[k];
+
+        long written = reload_board(&played, &edited);
+        if (written != changed || compare_screen(&played, board) != 0 || played.board_hash != edited.board_hash
+                || played.pos_x != pos_x || played.pos_y != pos_y) {
+            printf("\e[38;2;250;10;10mReloaded board %d wrote %ld cells for %ld changes\n", n, written, changed);
+            return 1;
+        }
+        swap_screens(&played);
+        for (int t = 0; t < 8; ++t) {
+            played.key = fresh.key = (seed >> t) % 5;
+            update(&played);
+            swap_screens(&played);
+            update(&fresh);
+            swap_screens(&fresh);
+            copy_board(&fresh, fresh.front ^ 1, board);
+            copy_board(&played, played.front ^ 1, before);
+            if (memcmp(board, before, size) != 0 || played.dead != fresh.dead || played.board_hash != fresh.board_hash) {
+                printf("\e[38;2;250;10;10mReloaded board %d differs from the fresh load after tick %d\n", n, t);
+                return 1;
+            }
+        }
+        free(before);
+        free(board);
+        free_game_state(&played);
+        free_game_state(&fresh);
+        free_game_state(&edited);
+    }
+    return 0;
+}
+
+// A streamed level with room for only a few chunks plays like the whole level,
+// while the player walks off and chunks are evicted and paged in again.
+int test_streamed_level_matches_loaded() {
+    unsigned int seed = 4150755663u;
+    long evicted = 0, page_ins = 0;
+    for (int n = 0; n < 60; ++n) {
+        int width = 70 + (n * 37) % 200, height = 40 + (n * 53) % 150, pos_x, pos_y;
+        int engine = n % 2 ? ENGINE_LUT : ENGINE_SCAN;
+        char* board = allocate((size_t)width * height, 1);
+        random_board(board, width, height, &seed, &pos_x, &pos_y);
+        GameState text = { .engine = engine }, loaded = { .engine = engine }, streamed = { .engine = engine };
+        LevelInfo info;
+        load_text_level(&text, board, (size_t)width * height, &info);
+        uint8_t* level;
+        size_t size = write_binary_level(&text, text.front, &level);
+        if (load_binary_level(&streamed, level, size, 1, &info) == 0) {
+            printf("\e[38;2;250;10;10mLevel %d was streamed before it settled\n", n);
+            return 1;
+        }
+        free(level);
+        long settled = settle_level(&text, 100000);
+        if (settled < 0 || settled == 100000) {
+            free(board);
+            free_game_state(&text);
+            continue;
+        }
+        size = write_binary_level(&text, text.front, &level);
+        if (load_binary_level(&loaded, level, size, 0, &info) != 0 || load_binary_level(&streamed, level, size, 1, &info) != 0) {
+            printf("\e[38;2;250;10;10mSettled level %d does not load: %s\n", n, info.error);
+            return 1;
+        }
+        start_stream(&streamed, level, size, 0, 2);
+        char* expected = allocate((size_t)width * height, 1);
+        for (int t = 0; t < 80; ++t) {
+            seed = seed * 1103515245u + 12345u;
+            loaded.key = streamed.key = (seed >> 16) % 5;
+            long resident = streamed.resident_chunks;
+            update(&loaded);
+            swap_screens(&loaded);
+            update(&streamed);
+            swap_screens(&streamed);
+            page_ins += streamed.resident_chunks > resident;
+            copy_board(&loaded, loaded.front ^ 1, expected);
+            copy_board(&streamed, streamed.front ^ 1, board);
+            if (memcmp(board, expected, (size_t)width * height) != 0 || state_hash(&loaded) != state_hash(&streamed)) {
+                printf("\e[38;2;250;10;10mStreamed level %d differs after tick %d\n", n, t);
+                return 1;
+            }
+            if (loaded.dead || loaded.won) break;
+        }
+        evicted += streamed.stream->evicted;
+        free(expected);
+        free(board);
+        free_game_state(&text);
+        free_game_state(&loaded);
+        free_game_state(&streamed);
+    }
+    if (!evicted || !page_ins) {
+        printf("\e[38;2;250;10;10mStreamed levels evicted %ld chunks and paged in on %ld ticks\n", evicted, page_ins);
         return 1;
     }
+    return 0;
+}
 
+int test_threads_match_single_thread() {
+    const int width = 24, height = 12;
+    WorkerPool* pool = start_worker_pool(3, width, height);
+    unsigned int seed = 521288629u;
+    for (int n = 0; n < 500; ++n) {
+        int pos_x, pos_y;
+        GameState single = { .engine = ENGINE_TWO_BUFFER };
+        GameState striped = { .engine = ENGINE_TWO_BUFFER, .pool = pool };
+        init_game_state(&single, width, height);
+        init_game_state(&striped, width, height);
+        char board[24 * 12];
+        random_board(board, width, height, &seed, &pos_x, &pos_y);
+        load_board(&single, board);
+        load_board(&striped, board);
+        single.pos_x = striped.pos_x = pos_x;
+        single.pos_y = striped.pos_y = pos_y;
+
+        for (int t = 0; t < 8; ++t) {
+            single.key = striped.key = (seed >> t) % 5;
+            update(&single);
+            update(&striped);
+            copy_board(&striped, striped.front, board);
+            if (compare_screen(&single, board) != 0 || single.dead != striped.dead) {
+                printf("\e[38;2;250;10;10mStriped update differs on board %d after tick %d\n", n, t);
+                stop_worker_pool(pool);
+                return 1;
+            }
+            swap_screens(&single);
+            swap_screens(&striped);
+        }
+        free_game_state(&single);
+        free_game_state(&striped);
+    }
+    stop_worker_pool(pool);
     return 0;
 }
 
@@ -594,6 +5176,186 @@ int main() {
     evaluation += ret;
     ++tests;
 
+    ret = test_resting_rocks_sleep();
+    if (ret != 0) {
+        printf("\e[38;2;250;10;10mTest Resting Rocks Sleep - Failed\n");
+    } else {
+        printf("\e[38;2;10;250;10mTest Resting Rocks Sleep - Successful\n");
+    }
+    evaluation += ret;
+    ++tests;
+
+    ret = test_bitboard_matches_scan();
+    if (ret != 0) {
+        printf("\e[38;2;250;10;10mTest Bitboard Matches Scan - Failed\n");
+    } else {
+        printf("\e[38;2;10;250;10mTest Bitboard Matches Scan - Successful\n");
+    }
+    evaluation += ret;
+    ++tests;
+
+    ret = test_lut_matches_scan();
+    if (ret != 0) {
+        printf("\e[38;2;250;10;10mTest LUT Matches Scan - Failed\n");
+    } else {
+        printf("\e[38;2;10;250;10mTest LUT Matches Scan - Successful\n");
+    }
+    evaluation += ret;
+    ++tests;
+
+    ret = test_entities_match_scan();
+    if (ret != 0) {
+        printf("\e[38;2;250;10;10mTest Entities Match Scan - Failed\n");
+    } else {
+        printf("\e[38;2;10;250;10mTest Entities Match Scan - Successful\n");
+    }
+    evaluation += ret;
+    ++tests;
+
+    ret = test_two_buffer_reads_previous_board();
+    if (ret != 0) {
+        printf("\e[38;2;250;10;10mTest Two Buffer Reads Previous Board - Failed\n");
+    } else {
+        printf("\e[38;2;10;250;10mTest Two Buffer Reads Previous Board - Successful\n");
+    }
+    evaluation += ret;
+    ++tests;
+
+    ret = test_sleeping_chunks_match_awake_board();
+    if (ret != 0) {
+        printf("\e[38;2;250;10;10mTest Sleeping Chunks Match Awake Board - Failed\n");
+    } else {
+        printf("\e[38;2;10;250;10mTest Sleeping Chunks Match Awake Board - Successful\n");
+    }
+    evaluation += ret;
+    ++tests;
+
+    ret = test_packed_chunk_round_trip();
+    if (ret != 0) {
+        printf("\e[38;2;250;10;10mTest Packed Chunk Round Trip - Failed\n");
+    } else {
+        printf("\e[38;2;10;250;10mTest Packed Chunk Round Trip - Successful\n");
+    }
+    evaluation += ret;
+    ++tests;
+
+    ret = test_sliced_ticks_match_whole_ticks();
+    if (ret != 0) {
+        printf("\e[38;2;250;10;10mTest Sliced Ticks Match Whole Ticks - Failed\n");
+    } else {
+        printf("\e[38;2;10;250;10mTest Sliced Ticks Match Whole Ticks - Successful\n");
+    }
+    evaluation += ret;
+    ++tests;
+
+    ret = test_settle_matches_idle_ticks();
+    if (ret != 0) {
+        printf("\e[38;2;250;10;10mTest Settle Matches Idle Ticks - Failed\n");
+    } else {
+        printf("\e[38;2;10;250;10mTest Settle Matches Idle Ticks - Successful\n");
+    }
+    evaluation += ret;
+    ++tests;
+
+    ret = test_incremental_hash();
+    if (ret != 0) {
+        printf("\e[38;2;250;10;10mTest Incremental Hash - Failed\n");
+    } else {
+        printf("\e[38;2;10;250;10mTest Incremental Hash - Successful\n");
+    }
+    evaluation += ret;
+    ++tests;
+
+    ret = test_parse_level();
+    if (ret != 0) {
+        printf("\e[38;2;250;10;10mTest Parse Level - Failed\n");
+    } else {
+        printf("\e[38;2;10;250;10mTest Parse Level - Successful\n");
+    }
+    evaluation += ret;
+    ++tests;
+
+    ret = test_binary_level_round_trip();
+    if (ret != 0) {
+        printf("\e[38;2;250;10;10mTest Binary Level Round Trip - Failed\n");
+    } else {
+        printf("\e[38;2;10;250;10mTest Binary Level Round Trip - Successful\n");
+    }
+    evaluation += ret;
+    ++tests;
+
+    ret = test_pack_levels();
+    if (ret != 0) {
+        printf("\e[38;2;250;10;10mTest Pack Levels - Failed\n");
+    } else {
+        printf("\e[38;2;10;250;10mTest Pack Levels - Successful\n");
+    }
+    evaluation += ret;
+    ++tests;
+
+    ret = test_replay_matches_recording();
+    if (ret != 0) {
+        printf("\e[38;2;250;10;10mTest Replay Matches Recording - Failed\n");
+    } else {
+        printf("\e[38;2;10;250;10mTest Replay Matches Recording - Successful\n");
+    }
+    evaluation += ret;
+    ++tests;
+
+    ret = test_seek_matches_replay();
+    if (ret != 0) {
+        printf("\e[38;2;250;10;10mTest Seek Matches Replay - Failed\n");
+    } else {
+        printf("\e[38;2;10;250;10mTest Seek Matches Replay - Successful\n");
+    }
+    evaluation += ret;
+    ++tests;
+
+    ret = test_skip_render_keeps_view_damage();
+    if (ret != 0) {
+        printf("\e[38;2;250;10;10mTest Skip Render Keeps View Damage - Failed\n");
+    } else {
+        printf("\e[38;2;10;250;10mTest Skip Render Keeps View Damage - Successful\n");
+    }
+    evaluation += ret;
+    ++tests;
+
+    ret = test_rewind_matches_earlier_ticks();
+    if (ret != 0) {
+        printf("\e[38;2;250;10;10mTest Rewind Matches Earlier Ticks - Failed\n");
+    } else {
+        printf("\e[38;2;10;250;10mTest Rewind Matches Earlier Ticks - Successful\n");
+    }
+    evaluation += ret;
+    ++tests;
+
+    ret = test_reload_matches_fresh_load();
+    if (ret != 0) {
+        printf("\e[38;2;250;10;10mTest Reload Matches Fresh Load - Failed\n");
+    } else {
+        printf("\e[38;2;10;250;10mTest Reload Matches Fresh Load - Successful\n");
+    }
+    evaluation += ret;
+    ++tests;
+
+    ret = test_streamed_level_matches_loaded();
+    if (ret != 0) {
+        printf("\e[38;2;250;10;10mTest Streamed Level Matches Loaded - Failed\n");
+    } else {
+        printf("\e[38;2;10;250;10mTest Streamed Level Matches Loaded - Successful\n");
+    }
+    evaluation += ret;
+    ++tests;
+
+    ret = test_threads_match_single_thread();
+    if (ret != 0) {
+        printf("\e[38;2;250;10;10mTest Threads Match Single Thread - Failed\n");
+    } else {
+        printf("\e[38;2;10;250;10mTest Threads Match Single Thread - Successful\n");
+    }
+    evaluation += ret;
+    ++tests;
+
     if (evaluation == 0) {
         printf("\e[38;2;10;250;10mALL %d test were Successful\n", tests);
     } else {